@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "ds3900.h"
+#include "pmbus.h"
+#include "smbus.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Host CPU cost of the protocol paths, measured against an in-memory DS3900
+ * over two transports. Over a socketpair, the adapter end is loaded with
+ * canned responses before each batch and drained of requests after it, so
+ * only the library code and the socket syscalls themselves fall inside the
+ * timed region. In-process, read() and write() on a reserved fd are served
+ * without entering the kernel, leaving just the encode and validate paths.
+ *
+ * Each case gets an untimed warm-up pass, then BENCH_REPEATS timed passes of
+ * which the fastest and the median are reported.
+ */
+
+#define BENCH_ITERATIONS	50000
+#define BENCH_REPEATS		7
+#define BENCH_BATCH		64
+#define BENCH_RSP_MAX		2
+#define BENCH_ADDR		0x52
+
+/* No open file gets this number, so it is served by read() and write() below */
+#define BENCH_FAKE_FD		INT_MAX
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static unsigned long bench_allocs;
+
+void *malloc(size_t size)
+{
+	bench_allocs++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	bench_allocs++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	bench_allocs++;
+	return __libc_realloc(ptr, size);
+}
+
+struct bench_rsp {
+	uint8_t len;
+	uint8_t data[DS3900_PACKET_MAX + 1];
+};
+
+struct bench_ctx {
+	int fd;				/* The library's end */
+	int peer;			/* The adapter's end, -1 in-process */
+	struct ds3900_bus ds3900;
+	struct pmbus_dev dev;
+	uint8_t page;
+	volatile uint8_t sink;
+};
+
+struct bench_case {
+	const char *name;
+	int (*op)(struct bench_ctx *ctx);
+	size_t nrsps;			/* Transfers per operation */
+	struct bench_rsp rsps[BENCH_RSP_MAX];
+	bool pec;
+	bool syscalls;			/* Only meaningful over the socketpair */
+};
+
+/* Requests are discarded and the case's responses replayed in turn */
+static const struct bench_case *bench_fake_case;
+static size_t bench_fake_next;
+
+ssize_t read(int fd, void *buf, size_t count)
+{
+	const struct bench_rsp *rsp;
+	size_t len;
+
+	if (fd != BENCH_FAKE_FD)
+		return syscall(SYS_read, fd, buf, count);
+
+	if (!bench_fake_case || !bench_fake_case->nrsps) {
+		errno = EIO;
+		return -1;
+	}
+
+	rsp = &bench_fake_case->rsps[bench_fake_next];
+	bench_fake_next = (bench_fake_next + 1) % bench_fake_case->nrsps;
+
+	len = rsp->len < count ? rsp->len : count;
+	memcpy(buf, rsp->data, len);
+
+	return len;
+}
+
+ssize_t write(int fd, const void *buf, size_t count)
+{
+	if (fd != BENCH_FAKE_FD)
+		return syscall(SYS_write, fd, buf, count);
+
+	return count;
+}
+
+static int64_t bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int bench_syscalls(struct bench_ctx *ctx)
+{
+	uint8_t buf[3] = { 0, 0x91, PMBUS_READ_FAN_SPEED_1 };
+
+	if (write(ctx->fd, buf, sizeof(buf)) != sizeof(buf))
+		return -EIO;
+
+	if (read(ctx->fd, buf, sizeof(buf)) != sizeof(buf))
+		return -EIO;
+
+	return 0;
+}
+
+static int bench_packet_op(struct bench_ctx *ctx)
+{
+	struct ds3900_cmd cmd;
+
+	cmd = ds3900_cmd_packet_read;
+	ds3900_packet_op(&cmd, PMBUS_READ_FAN_SPEED_1, 2);
+	ctx->sink = cmd.rsp.len;
+
+	return 0;
+}
+
+static int bench_xfer_read(struct bench_ctx *ctx)
+{
+	struct ds3900_cmd cmd;
+	uint8_t buf[2];
+
+	cmd = ds3900_cmd_packet_read;
+	ds3900_packet_op(&cmd, PMBUS_READ_FAN_SPEED_1, sizeof(buf));
+
+	return ds3900_xfer(ctx->fd, cmd, buf, sizeof(buf));
+}
+
+static int bench_xfer_write(struct bench_ctx *ctx)
+{
+	struct ds3900_cmd cmd;
+	const uint8_t buf[2] = { 0x10, 0x27 };
+
+	cmd = ds3900_cmd_packet_write;
+	ds3900_packet_op(&cmd, PMBUS_FAN_COMMAND_1, sizeof(buf));
+
+	return ds3900_xfer_write(ctx->fd, cmd, buf, sizeof(buf));
+}
+
+static int bench_smbus_read_word(struct bench_ctx *ctx)
+{
+	ssize_t rc;
+
+	rc = smbus_read_word(&ctx->ds3900.bus, BENCH_ADDR, PMBUS_READ_FAN_SPEED_1);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int bench_smbus_write_word(struct bench_ctx *ctx)
+{
+	ssize_t rc;
+
+	rc = smbus_write_word(&ctx->ds3900.bus, BENCH_ADDR, PMBUS_FAN_COMMAND_1,
+			      10000);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int bench_pmbus_read_word(struct bench_ctx *ctx)
+{
+	int rc;
+
+	rc = pmbus_read_word(&ctx->dev, 0, PMBUS_READ_FAN_SPEED_1);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int bench_pmbus_read_paged(struct bench_ctx *ctx)
+{
+	int rc;
+
+	ctx->page ^= 1;
+	rc = pmbus_read_word(&ctx->dev, ctx->page, PMBUS_READ_FAN_SPEED_1);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int bench_pmbus_read_cached(struct bench_ctx *ctx)
+{
+	int rc;
+
+	rc = pmbus_fan_config_get_enabled(&ctx->dev, 0, pmbus_fan_1);
+
+	return rc < 0 ? rc : 0;
+}
+
+static int bench_pmbus_write_word(struct bench_ctx *ctx)
+{
+	return pmbus_fan_command_set(&ctx->dev, 0, pmbus_fan_1, 10000);
+}
+
+/* Responses carry the data bytes, then the echoed packet command */
+#define RSP_READ_WORD		{ 3, { 0x10, 0x27, 0x91 } }
+#define RSP_READ_WORD_PEC(p)	{ 4, { 0x10, 0x27, (p), 0x92 } }
+#define RSP_WRITE_BYTE		{ 1, { 0x80 } }
+#define RSP_WRITE_WORD		{ 1, { 0x81 } }
+
+static struct bench_case bench_cases[] = {
+	{
+		.name = "syscall floor (write+read)",
+		.op = bench_syscalls,
+		.nrsps = 1, .rsps = { RSP_READ_WORD },
+		.syscalls = true,
+	}, {
+		.name = "ds3900_packet_op",
+		.op = bench_packet_op,
+	}, {
+		.name = "ds3900_xfer read word",
+		.op = bench_xfer_read,
+		.nrsps = 1, .rsps = { RSP_READ_WORD },
+	}, {
+		.name = "ds3900_xfer_write word",
+		.op = bench_xfer_write,
+		.nrsps = 1, .rsps = { RSP_WRITE_WORD },
+	}, {
+		.name = "smbus_read_word",
+		.op = bench_smbus_read_word,
+		.nrsps = 1, .rsps = { RSP_READ_WORD },
+	}, {
+		.name = "smbus_read_word (PEC)",
+		.op = bench_smbus_read_word,
+		.nrsps = 1, .rsps = { RSP_READ_WORD_PEC(0) },
+		.pec = true,
+	}, {
+		.name = "smbus_write_word",
+		.op = bench_smbus_write_word,
+		.nrsps = 1, .rsps = { RSP_WRITE_WORD },
+	}, {
+		.name = "pmbus_read_word",
+		.op = bench_pmbus_read_word,
+		.nrsps = 1, .rsps = { RSP_READ_WORD },
+	}, {
+		.name = "pmbus_read_word (page change)",
+		.op = bench_pmbus_read_paged,
+		.nrsps = 2, .rsps = { RSP_WRITE_BYTE, RSP_READ_WORD },
+	}, {
+		.name = "pmbus_read_byte (cached)",
+		.op = bench_pmbus_read_cached,
+	}, {
+		.name = "pmbus_write_word",
+		.op = bench_pmbus_write_word,
+		.nrsps = 1, .rsps = { RSP_WRITE_WORD },
+	},
+};
+
+static void bench_fill_pec(void)
+{
+	const uint8_t msg[] = {
+		BENCH_ADDR << 1, PMBUS_READ_FAN_SPEED_1, (BENCH_ADDR << 1) | 1,
+		0x10, 0x27,
+	};
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		if (bench_cases[i].pec)
+			bench_cases[i].rsps[0].data[2] =
+				smbus_pec_update(0, msg, sizeof(msg));
+	}
+}
+
+/* Put the device in the state each operation expects: latched, on page 0 */
+static void bench_reset(struct bench_ctx *ctx, const struct bench_case *c)
+{
+	ds3900_bus_init(&ctx->ds3900, ctx->fd);
+	ctx->ds3900.dev = BENCH_ADDR;
+	smbus_set_pec(&ctx->ds3900.bus, c->pec, 0);
+
+	pmbus_dev_init(&ctx->dev, &ctx->ds3900.bus, BENCH_ADDR);
+	ctx->dev.page = 0;
+	ctx->dev.cache[0].val[0] = PMBUS_FAN_CONFIG_1_ENABLED;
+	ctx->dev.cache[0].valid = BIT(0);
+	ctx->page = 0;
+}
+
+/* Time @iterations operations, loading and draining the socket in batches */
+static int bench_pass(struct bench_ctx *ctx, const struct bench_case *c,
+		      unsigned long iterations, int64_t *elapsed,
+		      unsigned long *allocs)
+{
+	uint8_t drain[DS3900_PACKET_MAX + 4];
+	unsigned long done;
+	size_t i, j;
+	int rc;
+
+	*elapsed = 0;
+	*allocs = 0;
+	for (done = 0; done < iterations; done += BENCH_BATCH) {
+		size_t n = iterations - done < BENCH_BATCH ?
+			   iterations - done : BENCH_BATCH;
+		unsigned long before;
+		int64_t start;
+
+		for (i = 0; ctx->peer >= 0 && i < n; i++) {
+			for (j = 0; j < c->nrsps; j++) {
+				const struct bench_rsp *rsp = &c->rsps[j];
+
+				if (write(ctx->peer, rsp->data, rsp->len) != rsp->len)
+					return -EIO;
+			}
+		}
+
+		before = bench_allocs;
+		start = bench_now();
+
+		for (i = 0; i < n; i++) {
+			rc = c->op(ctx);
+			if (rc < 0)
+				return rc;
+		}
+
+		*elapsed += bench_now() - start;
+		*allocs += bench_allocs - before;
+
+		for (i = 0; ctx->peer >= 0 && i < n * c->nrsps; i++) {
+			if (recv(ctx->peer, drain, sizeof(drain), 0) < 0)
+				return -errno;
+		}
+	}
+
+	return 0;
+}
+
+static int bench_cmp_ns(const void *a, const void *b)
+{
+	int64_t l = *(const int64_t *)a, r = *(const int64_t *)b;
+
+	return (l > r) - (l < r);
+}
+
+static int bench_run(struct bench_ctx *ctx, const struct bench_case *c,
+		     unsigned long iterations)
+{
+	int64_t elapsed[BENCH_REPEATS];
+	unsigned long allocs, total;
+	size_t i;
+	int rc;
+
+	bench_reset(ctx, c);
+	bench_fake_case = c;
+	bench_fake_next = 0;
+
+	/* Warm the caches and branch predictors before timing anything */
+	rc = bench_pass(ctx, c, iterations, &elapsed[0], &allocs);
+	if (rc < 0)
+		return rc;
+
+	total = 0;
+	for (i = 0; i < BENCH_REPEATS; i++) {
+		rc = bench_pass(ctx, c, iterations, &elapsed[i], &allocs);
+		if (rc < 0)
+			return rc;
+
+		total += allocs;
+	}
+
+	qsort(elapsed, BENCH_REPEATS, sizeof(elapsed[0]), bench_cmp_ns);
+
+	printf("%-32s %10.1f ns/op min %10.1f ns/op median %8.3f allocs/op\n",
+	       c->name, (double)elapsed[0] / iterations,
+	       (double)elapsed[BENCH_REPEATS / 2] / iterations,
+	       (double)total / ((double)iterations * BENCH_REPEATS));
+
+	return 0;
+}
+
+/* Run every case against @fd, with @peer as the adapter's end or -1 */
+static int bench_transport(struct bench_ctx *ctx, const char *name, int fd,
+			   int peer, unsigned long iterations)
+{
+	size_t i;
+	int rc;
+
+	ctx->fd = fd;
+	ctx->peer = peer;
+
+	printf("%s:\n", name);
+
+	for (i = 0; i < ARRAY_SIZE(bench_cases); i++) {
+		const struct bench_case *c = &bench_cases[i];
+
+		if (peer < 0 && c->syscalls)
+			continue;
+
+		rc = bench_run(ctx, c, iterations);
+		if (rc < 0) {
+			fprintf(stderr, "%s: %s: %s\n", name, c->name,
+				strerror(-rc));
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned long iterations;
+	struct bench_ctx ctx;
+	int sv[2];
+	int rc;
+
+	iterations = argc > 1 ? strtoul(argv[1], NULL, 0) : BENCH_ITERATIONS;
+	if (!iterations) {
+		fprintf(stderr, "USAGE: %s [ITERATIONS]\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(&ctx, 0, sizeof(ctx));
+
+	bench_fill_pec();
+
+	rc = bench_transport(&ctx, "socketpair", sv[0], sv[1], iterations);
+	if (!rc)
+		rc = bench_transport(&ctx, "in-process", BENCH_FAKE_FD, -1,
+				     iterations);
+
+	close(sv[0]);
+	close(sv[1]);
+
+	return rc < 0 ? EXIT_FAILURE : 0;
+}
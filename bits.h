@@ -1,5 +1,15 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 /* Copyright (C) 2020 IBM Corp. */
 
+#ifndef BITS_H
+#define BITS_H
+
+#include <stddef.h>
+
 #define BIT(x) (1UL << (x))
-#define GENMASK(h, l) (((2UL << (h)) - 1) & ~((2UL << (l)) - 1))
+#define GENMASK(h, l) (((2UL << (h)) - 1) & ~((1UL << (l)) - 1))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#endif
@@ -0,0 +1,700 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "fakebus.h"
+#include "max31785.h"
+#include "plan.h"
+#include "pmbus.h"
+#include "profile.h"
+#include "state.h"
+#include "telemetry.h"
+#include "tslog.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * Checks of the PMBus paging and register cache against the in-memory
+ * transport, counting the transfers each access costs.
+ */
+
+#define CHECK_ADDR	0x52
+
+static unsigned check_failures;
+
+#define CHECK(cond)							\
+	do {								\
+		if (!(cond)) {						\
+			fprintf(stderr, "%s:%d: %s: check failed: %s\n",	\
+				__FILE__, __LINE__, __func__, #cond);	\
+			check_failures++;				\
+		}							\
+	} while (0)
+
+static void check_setup(struct fake_bus *fake, struct pmbus_dev *dev,
+			bool paged_read)
+{
+	fake_bus_init(fake, CHECK_ADDR, paged_read);
+	pmbus_dev_init(dev, &fake->bus, CHECK_ADDR);
+}
+
+/* PAGE is written only when the page changes, and only once per change */
+static void check_paging(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+
+	check_setup(&fake, &dev, false);
+	fake.regs[1][PMBUS_READ_FAN_SPEED_1] = 1000;
+	fake.regs[2][PMBUS_READ_FAN_SPEED_1] = 2000;
+
+	CHECK(pmbus_read_fan_speed(&dev, 1, pmbus_fan_1) == 1000);
+	CHECK(pmbus_read_fan_speed(&dev, 1, pmbus_fan_1) == 1000);
+	CHECK(fake.page_writes == 1);
+	CHECK(fake.xfers == 3);
+
+	CHECK(pmbus_read_fan_speed(&dev, 2, pmbus_fan_1) == 2000);
+	CHECK(fake.page_writes == 2);
+	CHECK(fake.xfers == 5);
+
+	CHECK(pmbus_write_word(&dev, 2, PMBUS_FAN_COMMAND_1, 0x1234) == 0);
+	CHECK(fake.regs[2][PMBUS_FAN_COMMAND_1] == 0x1234);
+	CHECK(fake.page_writes == 2);
+
+	/* After invalidation the device's page is unknown */
+	pmbus_dev_invalidate(&dev);
+	CHECK(pmbus_read_fan_speed(&dev, 2, pmbus_fan_1) == 2000);
+	CHECK(fake.page_writes == 3);
+}
+
+/* A page change and the read after it go out as one combined transfer */
+static void check_paged_read(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+
+	check_setup(&fake, &dev, true);
+	fake.regs[3][PMBUS_READ_FAN_SPEED_1] = 3000;
+
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == 3000);
+	CHECK(fake.xfers == 1);
+	CHECK(fake.page == 3);
+	CHECK(dev.page == 3);
+
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == 3000);
+	CHECK(fake.xfers == 2);
+	CHECK(fake.page_writes == 1);
+}
+
+/* With PEC the PAGE write and the read are separate, checked transfers */
+static void check_paged_read_pec(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+
+	check_setup(&fake, &dev, true);
+	smbus_set_pec(&fake.bus, true, 0);
+	fake.regs[3][PMBUS_READ_FAN_SPEED_1] = 3000;
+
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == 3000);
+	CHECK(fake.paged_reads == 0);
+	CHECK(fake.page_writes == 1);
+	CHECK(fake.xfers == 2);
+	CHECK(fake.bus.pec_errors == 0);
+}
+
+/* CRC-8 with polynomial 0x07, the standard check value */
+static void check_pec_crc(void)
+{
+	CHECK(smbus_pec_update(0, "123456789", 9) == 0xf4);
+	CHECK(smbus_pec_update(smbus_pec_update(0, "1234", 4), "56789", 5) ==
+	      0xf4);
+}
+
+/* A read with a bad PEC is repeated alone, up to pec_retries times */
+static void check_pec_retry(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+
+	check_setup(&fake, &dev, false);
+	smbus_set_pec(&fake.bus, true, 2);
+	fake.regs[3][PMBUS_READ_FAN_SPEED_1] = 3000;
+
+	/* Transfer 1 writes PAGE, the reads after it fail twice */
+	fake.corrupt = 2;
+	fake.ncorrupt = 2;
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == 3000);
+	CHECK(fake.bus.pec_errors == 2);
+	CHECK(fake.page_writes == 1);
+	CHECK(fake.xfers == 4);
+
+	/* One failure more than there are retries */
+	fake.corrupt = fake.xfers + 1;
+	fake.ncorrupt = 3;
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == -EBADMSG);
+	CHECK(fake.bus.pec_errors == 5);
+	CHECK(fake.page_writes == 1);
+	CHECK(fake.xfers == 7);
+
+	/* The next transfer is clean */
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == 3000);
+	CHECK(fake.bus.pec_errors == 5);
+	CHECK(fake.xfers == 8);
+
+	/* Without retries the first failure is reported */
+	smbus_set_pec(&fake.bus, true, 0);
+	fake.corrupt = fake.xfers + 1;
+	fake.ncorrupt = 1;
+	CHECK(pmbus_read_fan_speed(&dev, 3, pmbus_fan_1) == -EBADMSG);
+	CHECK(fake.bus.pec_errors == 6);
+	CHECK(fake.xfers == 9);
+}
+
+/* FAN_CONFIG is read once per page, and writes go through the cache */
+static void check_cache(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	unsigned long xfers;
+
+	check_setup(&fake, &dev, false);
+	fake.regs[0][PMBUS_FAN_CONFIG_12] = PMBUS_FAN_CONFIG_1_ENABLED;
+	fake.regs[1][PMBUS_FAN_CONFIG_12] = 0;
+
+	CHECK(pmbus_fan_config_get_enabled(&dev, 0, pmbus_fan_1) == 1);
+	xfers = fake.xfers;
+	CHECK(pmbus_fan_config_get_enabled(&dev, 0, pmbus_fan_1) == 1);
+	CHECK(pmbus_fan_config_get_mode(&dev, 0, pmbus_fan_1) ==
+	      pmbus_fan_mode_pwm);
+	CHECK(fake.xfers == xfers);
+
+	/* Entries are per page */
+	CHECK(pmbus_fan_config_get_enabled(&dev, 1, pmbus_fan_1) == 0);
+	CHECK(fake.xfers > xfers);
+
+	/* Write-through: the new value is served without a read */
+	CHECK(pmbus_fan_config_set_mode(&dev, 0, pmbus_fan_1,
+					pmbus_fan_mode_rpm) == 0);
+	CHECK(fake.regs[0][PMBUS_FAN_CONFIG_12] ==
+	      (PMBUS_FAN_CONFIG_1_ENABLED | PMBUS_FAN_CONFIG_1_MODE));
+	xfers = fake.xfers;
+	CHECK(pmbus_fan_config_get_mode(&dev, 0, pmbus_fan_1) ==
+	      pmbus_fan_mode_rpm);
+	CHECK(fake.xfers == xfers);
+
+	/* Setting the mode it already has costs no write */
+	CHECK(pmbus_fan_config_set_mode(&dev, 0, pmbus_fan_1,
+					pmbus_fan_mode_rpm) == 0);
+	CHECK(fake.xfers == xfers);
+}
+
+/* Accesses the cache can't represent drop the entry instead */
+static void check_cache_invalidation(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	unsigned long xfers;
+
+	check_setup(&fake, &dev, false);
+	fake.regs[0][PMBUS_FAN_CONFIG_12] = PMBUS_FAN_CONFIG_1_ENABLED;
+	fake.regs[1][PMBUS_FAN_CONFIG_12] = PMBUS_FAN_CONFIG_1_ENABLED;
+
+	CHECK(pmbus_fan_config_get_enabled(&dev, 0, pmbus_fan_1) == 1);
+	CHECK(pmbus_fan_config_get_enabled(&dev, 1, pmbus_fan_1) == 1);
+
+	/* A word access to a byte register isn't served from the cache */
+	fake.regs[0][PMBUS_FAN_CONFIG_12] = 0xab00;
+	CHECK(pmbus_read_word(&dev, 0, PMBUS_FAN_CONFIG_12) == 0xab00);
+
+	/* A word write drops the byte entry */
+	CHECK(pmbus_write_word(&dev, 0, PMBUS_FAN_CONFIG_12, 0) == 0);
+	xfers = fake.xfers;
+	CHECK(pmbus_fan_config_get_enabled(&dev, 0, pmbus_fan_1) == 0);
+	CHECK(fake.xfers > xfers);
+
+	/* A write to every page drops the entry on all of them */
+	CHECK(pmbus_write_byte(&dev, PMBUS_PAGE_ALL, PMBUS_FAN_CONFIG_12,
+			       0) == 0);
+	xfers = fake.xfers;
+	CHECK(pmbus_fan_config_get_enabled(&dev, 1, pmbus_fan_1) == 0);
+	CHECK(fake.xfers > xfers);
+}
+
+/* FAN_COMMAND is never cached, as other hosts may write it */
+static void check_cache_live(void)
+{
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	unsigned long xfers;
+
+	check_setup(&fake, &dev, false);
+	fake.regs[0][PMBUS_FAN_COMMAND_1] = 0x1000;
+
+	CHECK(pmbus_read_word(&dev, 0, PMBUS_FAN_COMMAND_1) == 0x1000);
+	CHECK(!dev.cache[0].valid);
+
+	fake.regs[0][PMBUS_FAN_COMMAND_1] = 0x2000;
+	xfers = fake.xfers;
+	CHECK(pmbus_read_word(&dev, 0, PMBUS_FAN_COMMAND_1) == 0x2000);
+	CHECK(fake.xfers > xfers);
+}
+
+/* Find each fan's enable, mode and command, as the CLI's fan paths do */
+static void check_discover(struct pmbus_dev *dev)
+{
+	int page;
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		CHECK(pmbus_fan_config_get_enabled(dev, page, pmbus_fan_1) == 1);
+		CHECK(pmbus_fan_config_get_mode(dev, page, pmbus_fan_1) >= 0);
+		CHECK(pmbus_fan_command_get(dev, page, pmbus_fan_1) == 0x2710);
+	}
+}
+
+static bool check_is_barrier(const struct pmbus_reg *r)
+{
+	return r->reg == PMBUS_MFR_REVISION;
+}
+
+/* Writes group by page, keep their order within it, and never cross barriers */
+static void check_regs_sort(void)
+{
+	struct pmbus_reg regs[] = {
+		{ .page = 2, .reg = PMBUS_FAN_CONFIG_12, .width = 1, .val = 1 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2, .val = 2 },
+		{ .page = 2, .reg = PMBUS_FAN_COMMAND_1, .width = 2, .val = 3 },
+		{ .page = 1, .reg = PMBUS_FAN_CONFIG_12, .width = 1, .val = 4 },
+		{ .page = 0, .reg = PMBUS_MFR_REVISION, .width = 2, .val = 5 },
+		{ .page = 3, .reg = PMBUS_FAN_COMMAND_1, .width = 2, .val = 6 },
+		{ .page = PMBUS_PAGE_ALL, .reg = PMBUS_FAN_COMMAND_2, .width = 2,
+		  .val = 7 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_2, .width = 2, .val = 8 },
+		{ .page = 0, .reg = PMBUS_FAN_COMMAND_2, .width = 2, .val = 9 },
+	};
+	const uint16_t want[] = { 2, 4, 1, 3, 5, 6, 7, 9, 8 };
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	size_t i;
+
+	pmbus_regs_sort(regs, ARRAY_SIZE(regs), check_is_barrier);
+	for (i = 0; i < ARRAY_SIZE(regs); i++)
+		CHECK(regs[i].val == want[i]);
+
+	/* Pages 1, 2, 0, 3, all, 0, 1 */
+	check_setup(&fake, &dev, false);
+	CHECK(pmbus_write_regs(&dev, regs, ARRAY_SIZE(regs)) == 0);
+	CHECK(fake.page_writes == 7);
+	CHECK(fake.regs[2][PMBUS_FAN_COMMAND_1] == 3);
+	CHECK(fake.regs[1][PMBUS_FAN_COMMAND_2] == 8);
+	CHECK(fake.regs[4][PMBUS_FAN_COMMAND_2] == 7);
+}
+
+/* Starting from a saved state costs fewer transfers than a cold start */
+static void check_state_warm_start(void)
+{
+	struct pmbus_dev dev, warm_dev;
+	struct fake_bus fake, warm;
+	unsigned long cold_xfers;
+	char path[64];
+	int page;
+
+	check_setup(&fake, &dev, false);
+	for (page = 0; page < PMBUS_PAGES; page++) {
+		fake.regs[page][PMBUS_MFR_REVISION] = 0x3030;
+		fake.regs[page][MAX31785_MFR_MODE] = 0x0002;
+	}
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		fake.regs[page][PMBUS_FAN_CONFIG_12] = PMBUS_FAN_CONFIG_1_ENABLED;
+		fake.regs[page][PMBUS_FAN_COMMAND_1] = 0x2710;
+	}
+
+	check_discover(&dev);
+	cold_xfers = fake.xfers;
+
+	snprintf(path, sizeof(path), "/tmp/max31785k-check.%d", (int)getpid());
+	CHECK(state_save(path, &dev, 1) == 0);
+
+	/* A later run finds the device as the last one left it */
+	warm = fake;
+	warm.xfers = 0;
+	pmbus_dev_init(&warm_dev, &warm.bus, CHECK_ADDR);
+	CHECK(state_load(path, &warm_dev, 1) == 1);
+	check_discover(&warm_dev);
+	CHECK(warm.xfers < cold_xfers);
+
+	/* A foreign FAN_COMMAND write doesn't discard the snapshot */
+	warm = fake;
+	warm.regs[2][PMBUS_FAN_COMMAND_1] = 0x1388;
+	pmbus_dev_init(&warm_dev, &warm.bus, CHECK_ADDR);
+	CHECK(state_load(path, &warm_dev, 1) == 1);
+	CHECK(pmbus_fan_command_get(&warm_dev, 2, pmbus_fan_1) == 0x1388);
+
+	/* A FAN_CONFIG change on a spot-checked page does */
+	warm = fake;
+	warm.regs[0][PMBUS_FAN_CONFIG_12] = 0;
+	pmbus_dev_init(&warm_dev, &warm.bus, CHECK_ADDR);
+	CHECK(state_load(path, &warm_dev, 1) == 0);
+
+	unlink(path);
+}
+
+/* Batched reads cost one PAGE write per page and keep their order */
+static void check_read_regs(void)
+{
+	struct pmbus_reg regs[] = {
+		{ .page = 1, .reg = PMBUS_READ_FAN_SPEED_1, .width = 2 },
+		{ .page = 2, .reg = PMBUS_READ_FAN_SPEED_1, .width = 2 },
+		{ .page = 1, .reg = PMBUS_STATUS_WORD, .width = 2 },
+		{ .page = 2, .reg = PMBUS_STATUS_WORD, .width = 2 },
+	};
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+
+	check_setup(&fake, &dev, false);
+	fake.regs[1][PMBUS_READ_FAN_SPEED_1] = 1;
+	fake.regs[2][PMBUS_READ_FAN_SPEED_1] = 2;
+	fake.regs[1][PMBUS_STATUS_WORD] = 3;
+	fake.regs[2][PMBUS_STATUS_WORD] = 4;
+
+	CHECK(pmbus_read_regs(&dev, regs, ARRAY_SIZE(regs)) == 0);
+	CHECK(fake.page_writes == 2);
+	CHECK(regs[0].val == 1 && regs[1].val == 2);
+	CHECK(regs[2].val == 3 && regs[3].val == 4);
+}
+
+/* Reads of one register merge at the widest width, and fan out its value */
+static void check_plan_merge(void)
+{
+	const struct plan_op ops[] = {
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 1 },
+		{ .page = 1, .reg = PMBUS_READ_FAN_SPEED_1, .width = 2 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2 },
+	};
+	uint16_t vals[ARRAY_SIZE(ops)];
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	struct plan plan;
+
+	CHECK(plan_compile(&plan, ops, ARRAY_SIZE(ops)) == 0);
+	CHECK(plan.nsteps == 2);
+	CHECK(plan.steps[0].reg == PMBUS_FAN_COMMAND_1 &&
+	      plan.steps[0].width == 2 && plan.steps[0].nresults == 2);
+
+	check_setup(&fake, &dev, false);
+	fake.regs[1][PMBUS_FAN_COMMAND_1] = 0xab12;
+	fake.regs[1][PMBUS_READ_FAN_SPEED_1] = 3000;
+
+	CHECK(plan_run(&plan, &dev, 1, vals) == 0);
+	CHECK(vals[0] == 0x12);
+	CHECK(vals[1] == 3000);
+	CHECK(vals[2] == 0xab12);
+	CHECK(fake.page_writes == 1);
+	CHECK(fake.xfers == 3);
+
+	plan_destroy(&plan);
+}
+
+/* A read after a write in a later segment observes the write */
+static void check_plan_read_after_write(void)
+{
+	const struct plan_op ops[] = {
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2,
+		  .write = true, .val = 0x2710 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2 },
+	};
+	uint16_t vals[ARRAY_SIZE(ops)];
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	struct plan plan;
+
+	CHECK(plan_compile(&plan, ops, ARRAY_SIZE(ops)) == 0);
+	CHECK(plan.nsteps == 3);
+
+	check_setup(&fake, &dev, false);
+	fake.regs[1][PMBUS_FAN_COMMAND_1] = 0x1388;
+
+	CHECK(plan_run(&plan, &dev, 1, vals) == 0);
+	CHECK(vals[0] == 0x1388);
+	CHECK(vals[2] == 0x2710);
+	CHECK(fake.page_writes == 1);
+
+	plan_destroy(&plan);
+}
+
+/* Writes aren't grouped across a write to every page */
+static void check_plan_page_all(void)
+{
+	const struct plan_op ops[] = {
+		{ .page = 2, .reg = PMBUS_FAN_COMMAND_1, .width = 2,
+		  .write = true, .val = 1 },
+		{ .page = PMBUS_PAGE_ALL, .reg = PMBUS_FAN_COMMAND_1,
+		  .width = 2, .write = true, .val = 2 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2,
+		  .write = true, .val = 3 },
+		{ .page = 2, .reg = PMBUS_FAN_COMMAND_2, .width = 2,
+		  .write = true, .val = 4 },
+	};
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	struct plan plan;
+
+	CHECK(plan_compile(&plan, ops, ARRAY_SIZE(ops)) == 0);
+	CHECK(plan.nsteps == 4);
+	CHECK(plan.steps[0].page == 2);
+	CHECK(plan.steps[1].page == PMBUS_PAGE_ALL);
+
+	check_setup(&fake, &dev, false);
+	CHECK(plan_run(&plan, &dev, 1, NULL) == 0);
+	CHECK(fake.regs[2][PMBUS_FAN_COMMAND_1] == 2);
+	CHECK(fake.regs[1][PMBUS_FAN_COMMAND_1] == 3);
+	CHECK(fake.regs[0][PMBUS_FAN_COMMAND_1] == 2);
+	CHECK(fake.regs[2][PMBUS_FAN_COMMAND_2] == 4);
+	CHECK(fake.page_writes == 4);
+
+	plan_destroy(&plan);
+}
+
+/* Each segment starts on the page the previous one ended on */
+static void check_plan_segment_page(void)
+{
+	const struct plan_op ops[] = {
+		{ .page = 3, .reg = PMBUS_READ_FAN_SPEED_1, .width = 2 },
+		{ .page = 1, .reg = PMBUS_READ_FAN_SPEED_1, .width = 2 },
+		{ .page = 1, .reg = PMBUS_FAN_COMMAND_1, .width = 2,
+		  .write = true, .val = 1 },
+		{ .page = 3, .reg = PMBUS_FAN_COMMAND_1, .width = 2,
+		  .write = true, .val = 3 },
+		{ .page = 1, .reg = PMBUS_STATUS_WORD, .width = 2 },
+		{ .page = 3, .reg = PMBUS_STATUS_WORD, .width = 2 },
+	};
+	uint16_t vals[ARRAY_SIZE(ops)];
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	struct plan plan;
+
+	CHECK(plan_compile(&plan, ops, ARRAY_SIZE(ops)) == 0);
+	CHECK(plan.nsteps == 6);
+	CHECK(plan.steps[0].page == 1 && plan.steps[1].page == 3);
+	CHECK(plan.steps[2].page == 3 && plan.steps[3].page == 1);
+	CHECK(plan.steps[4].page == 1 && plan.steps[5].page == 3);
+
+	check_setup(&fake, &dev, false);
+	fake.regs[1][PMBUS_READ_FAN_SPEED_1] = 1000;
+	fake.regs[3][PMBUS_READ_FAN_SPEED_1] = 3000;
+	fake.regs[3][PMBUS_STATUS_WORD] = 0x0800;
+
+	/* Pages 1, 3, 1, 3 where file order would need six PAGE writes */
+	CHECK(plan_run(&plan, &dev, 1, vals) == 0);
+	CHECK(vals[0] == 3000 && vals[1] == 1000);
+	CHECK(vals[4] == 0 && vals[5] == 0x0800);
+	CHECK(fake.regs[3][PMBUS_FAN_COMMAND_1] == 3);
+	CHECK(fake.page_writes == 4);
+
+	plan_destroy(&plan);
+}
+
+#define CHECK_TSLOG_SERIES	3
+#define CHECK_TSLOG_SAMPLES	3000
+
+/*
+ * Series 0 swings between 0 and 65535 for the largest deltas, and the uneven
+ * timestamp steps give negative as well as positive delta-of-deltas
+ */
+static void check_tslog_sample(size_t i, int64_t *t_us, uint16_t *vals)
+{
+	*t_us = 1600000000000000LL + i * 1000 + (i % 7) * 100;
+	vals[0] = i & 1 ? 65535 : 0;
+	vals[1] = i * 37;
+	vals[2] = 1234;
+}
+
+static int check_tslog_write(const char *path)
+{
+	const struct tslog_series series[CHECK_TSLOG_SERIES] = {
+		{ CHECK_ADDR, 0 }, { CHECK_ADDR, 1 }, { CHECK_ADDR, 2 },
+	};
+	uint16_t vals[CHECK_TSLOG_SERIES];
+	struct tslog_writer w;
+	int64_t t_us;
+	size_t i;
+	int rc;
+
+	rc = tslog_writer_open(&w, path, series, CHECK_TSLOG_SERIES);
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i < CHECK_TSLOG_SAMPLES; i++) {
+		check_tslog_sample(i, &t_us, vals);
+		rc = tslog_writer_append(&w, t_us, vals);
+		if (rc < 0)
+			break;
+	}
+
+	CHECK(w.nblocks > 2);
+
+	if (!rc)
+		return tslog_writer_close(&w);
+
+	tslog_writer_close(&w);
+
+	return rc;
+}
+
+/* Read from the reader's position to the end, expecting samples @from on */
+static void check_tslog_read(struct tslog_reader *r, size_t from)
+{
+	uint16_t vals[CHECK_TSLOG_SERIES], want_vals[CHECK_TSLOG_SERIES];
+	int64_t t_us, want_t_us;
+	size_t i;
+
+	for (i = from; i < CHECK_TSLOG_SAMPLES; i++) {
+		if (tslog_reader_next(r, &t_us, vals) != 1) {
+			CHECK(!"sample missing");
+			return;
+		}
+
+		check_tslog_sample(i, &want_t_us, want_vals);
+		if (t_us != want_t_us ||
+		    memcmp(vals, want_vals, sizeof(vals))) {
+			CHECK(!"sample differs");
+			return;
+		}
+	}
+
+	CHECK(tslog_reader_next(r, &t_us, vals) == 0);
+}
+
+/* Seeks land on the first sample at or after the time asked for */
+static void check_tslog_seek(struct tslog_reader *r)
+{
+	uint16_t vals[CHECK_TSLOG_SERIES];
+	int64_t t_us, first, last;
+
+	check_tslog_sample(0, &first, vals);
+	check_tslog_sample(CHECK_TSLOG_SAMPLES - 1, &last, vals);
+
+	CHECK(tslog_reader_seek(r, first - 1) == 0);
+	check_tslog_read(r, 0);
+
+	check_tslog_sample(1234, &t_us, vals);
+	CHECK(tslog_reader_seek(r, t_us) == 0);
+	check_tslog_read(r, 1234);
+
+	CHECK(tslog_reader_seek(r, t_us + 1) == 0);
+	check_tslog_read(r, 1235);
+
+	CHECK(tslog_reader_seek(r, last) == 0);
+	check_tslog_read(r, CHECK_TSLOG_SAMPLES - 1);
+
+	CHECK(tslog_reader_seek(r, last + 1) == 0);
+	CHECK(tslog_reader_next(r, &t_us, vals) == 0);
+}
+
+static void check_tslog(void)
+{
+	struct tslog_reader r;
+	char path[64];
+	size_t nblocks;
+	struct stat st;
+
+	snprintf(path, sizeof(path), "/tmp/max31785k-check.%d.tsl",
+		 (int)getpid());
+
+	/* A closed log round-trips through its index */
+	CHECK(check_tslog_write(path) == 0);
+	CHECK(tslog_reader_open(&r, path) == 0);
+	CHECK(r.index);
+	nblocks = r.nblocks;
+	check_tslog_read(&r, 0);
+	check_tslog_seek(&r);
+	tslog_reader_close(&r);
+
+	/* A log without its index is searched through the block headers */
+	CHECK(truncate(path, TSLOG_BLOCK_SIZE * (1 + nblocks)) == 0);
+	CHECK(tslog_reader_open(&r, path) == 0);
+	CHECK(!r.index && r.nblocks == nblocks);
+	check_tslog_seek(&r);
+	tslog_reader_close(&r);
+
+	/* A torn index is ignored, and so is a torn block */
+	CHECK(check_tslog_write(path) == 0);
+	CHECK(stat(path, &st) == 0);
+	CHECK(truncate(path, st.st_size - 3) == 0);
+	CHECK(tslog_reader_open(&r, path) == 0);
+	CHECK(!r.index && r.nblocks == nblocks);
+	check_tslog_read(&r, 0);
+	tslog_reader_close(&r);
+
+	CHECK(truncate(path, TSLOG_BLOCK_SIZE * nblocks + 100) == 0);
+	CHECK(tslog_reader_open(&r, path) == 0);
+	CHECK(!r.index && r.nblocks == nblocks - 1);
+	tslog_reader_close(&r);
+
+	unlink(path);
+}
+
+/* A full capture is thinned rather than cut short */
+static void check_profile_thin(void)
+{
+	struct profile_capture cap;
+	struct pmbus_dev dev;
+	struct fake_bus fake;
+	int64_t span;
+	size_t i;
+
+	CHECK(profile_capture_init(&cap, 1) == -EINVAL);
+	CHECK(profile_capture_init(&cap, 5) == 0);
+
+	check_setup(&fake, &dev, false);
+	fake.regs[1][PMBUS_READ_FAN_SPEED_1] = 1000;
+
+	CHECK(profile_step(&dev, 1, pmbus_fan_1, 0x2710, 50, &cap) == 0);
+	CHECK(cap.stride > 1);
+	CHECK(cap.nsamples >= 3 && cap.nsamples <= 5);
+	CHECK(fake.regs[1][PMBUS_FAN_COMMAND_1] == 0x2710);
+
+	for (i = 1; i < cap.nsamples; i++)
+		CHECK(cap.samples[i].t_ns > cap.samples[i - 1].t_ns);
+
+	span = cap.samples[cap.nsamples - 1].t_ns - cap.t0_ns;
+	CHECK(span > 25000000 && span <= 50000000);
+
+	profile_capture_destroy(&cap);
+}
+
+int main(void)
+{
+	check_paging();
+	check_paged_read();
+	check_paged_read_pec();
+	check_pec_crc();
+	check_pec_retry();
+	check_cache();
+	check_cache_invalidation();
+	check_cache_live();
+	check_read_regs();
+	check_regs_sort();
+	check_state_warm_start();
+	check_plan_merge();
+	check_plan_read_after_write();
+	check_plan_page_all();
+	check_plan_segment_page();
+	check_tslog();
+	check_profile_thin();
+
+	if (check_failures) {
+		fprintf(stderr, "%u checks failed\n", check_failures);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("All checks passed\n");
+
+	return 0;
+}
@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "decode.h"
+
+#include <string.h>
+
+/*
+ * Each format is decoded by its own branch-free loop over the whole array,
+ * with the coefficients folded into a single multiply-add beforehand so the
+ * compiler can vectorize the loop.
+ */
+
+static void decode_scaled_s16(const uint16_t *restrict raw, float *restrict out,
+			      size_t n, float scale, float offset)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (float)(int16_t)raw[i] * scale + offset;
+}
+
+static void decode_scaled_u16(const uint16_t *restrict raw, float *restrict out,
+			      size_t n, float scale, float offset)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++)
+		out[i] = (float)raw[i] * scale + offset;
+}
+
+/* 2^e for the LINEAR11 exponent range, built directly from the IEEE-754 bits */
+static inline float decode_exp2(int32_t e)
+{
+	uint32_t bits = (uint32_t)(e + 127) << 23;
+	float f;
+
+	memcpy(&f, &bits, sizeof(f));
+
+	return f;
+}
+
+static void decode_linear11_array(const uint16_t *restrict raw,
+				  float *restrict out, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		int32_t mantissa = (int16_t)(raw[i] << 5) >> 5;
+		int32_t exponent = (int16_t)raw[i] >> 11;
+
+		out[i] = (float)mantissa * decode_exp2(exponent);
+	}
+}
+
+static float decode_pow10(int R)
+{
+	float p = 1.0f;
+
+	for (; R > 0; R--)
+		p *= 10.0f;
+
+	for (; R < 0; R++)
+		p /= 10.0f;
+
+	return p;
+}
+
+/* Convert @n raw register values to engineering units */
+void decode_array(const struct decode_coeff *coeff, const uint16_t *raw,
+		  float *out, size_t n)
+{
+	float scale, offset;
+
+	switch (coeff->format) {
+		case decode_direct:
+			scale = 1.0f / (decode_pow10(coeff->R) * coeff->m);
+			offset = -(float)coeff->b / coeff->m;
+
+			if (coeff->is_signed)
+				decode_scaled_s16(raw, out, n, scale, offset);
+			else
+				decode_scaled_u16(raw, out, n, scale, offset);
+			break;
+		case decode_linear11:
+			decode_linear11_array(raw, out, n);
+			break;
+		case decode_linear16:
+			decode_scaled_u16(raw, out, n, decode_exp2(coeff->R), 0);
+			break;
+	}
+}
+
+float decode_one(const struct decode_coeff *coeff, uint16_t raw)
+{
+	float val;
+
+	decode_array(coeff, &raw, &val, 1);
+
+	return val;
+}
+
+/* The signed 5-bit exponent of a LINEAR mode VOUT_MODE value */
+int8_t decode_vout_mode_exponent(uint8_t vout_mode)
+{
+	return (int8_t)(vout_mode << 3) >> 3;
+}
@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef DECODE_H
+#define DECODE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+enum decode_format {
+	decode_direct,		/* X = (Y * 10^-R - b) / m */
+	decode_linear11,	/* 5-bit exponent, 11-bit mantissa */
+	decode_linear16,	/* Unsigned mantissa, exponent from VOUT_MODE */
+};
+
+struct decode_coeff {
+	enum decode_format format;
+	bool is_signed;		/* DIRECT only, Y is two's complement */
+	int16_t m;
+	int16_t b;
+	int8_t R;		/* The exponent for LINEAR16 */
+	const char *unit;
+};
+
+void decode_array(const struct decode_coeff *coeff, const uint16_t *raw,
+		  float *out, size_t n);
+float decode_one(const struct decode_coeff *coeff, uint16_t raw);
+
+int8_t decode_vout_mode_exponent(uint8_t vout_mode);
+
+#endif
@@ -1,11 +1,11 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2020 IBM Corp.
 
+#include "bits.h"
 #include "ds3900.h"
 
 #include <errno.h>
 #include <stdbool.h>
-#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -75,73 +75,90 @@ const struct ds3900_cmd ds3900_cmd_read_revision = {
 	.rsp = { .rsp = 0xd2, .len = 3 },
 };
 
-int ds3900_xfer(int fd, const struct ds3900_cmd cmd, void *buf, size_t len)
+static bool ds3900_is_packet_write(const struct ds3900_cmd *cmd)
 {
-	struct ds3900_hid_out_report *tx, _tx;
+	return (cmd->cmd.cmd & 0xf0) == 0x80;
+}
+
+/* Send @cmd and @tx_len bytes of @tx_data, copying the response to @rx */
+static int ds3900_xfer_buf(int fd, const struct ds3900_cmd *cmd,
+			   const void *tx_data, size_t tx_len, void *rx,
+			   size_t rx_len)
+{
+	uint8_t tx_buf[sizeof(struct ds3900_hid_out_report) + DS3900_PACKET_MAX];
+	struct ds3900_hid_out_report *tx;
 	ssize_t egress, ingress;
-	uint8_t rx_buf[16 + 1];
-	bool is_packet_write;
-	size_t tx_len;
+	uint8_t rx_buf[DS3900_PACKET_MAX + 1];
 
-	if (cmd.rsp.len > (sizeof(rx_buf) - 1))
+	if (cmd->rsp.len > (sizeof(rx_buf) - 1))
 		return -EINVAL;
 
-	if (len == SIZE_MAX)
+	if (rx_len == SIZE_MAX)
 		return -EINVAL;
 
-	if (cmd.rsp.len > (len + 1))
+	if (cmd->rsp.len > (rx_len + 1))
 		return -EINVAL;
 
-	if (!buf && len > 0)
+	if ((!rx && rx_len > 0) || (!tx_data && tx_len > 0))
 		return -EINVAL;
 
-	is_packet_write = ((cmd.cmd.cmd & 0xf0) == 0x80);
-
-	if (is_packet_write) {
-		tx_len = sizeof(*tx) + len;
-		tx = malloc(tx_len);
-		if (!tx)
-			return -ENOMEM;
-		memcpy(tx->tail, buf, len);
-	} else {
-		tx_len = sizeof(*tx);
-		tx = &_tx;
-	}
+	if (tx_len > DS3900_PACKET_MAX)
+		return -EINVAL;
+
+	tx = (struct ds3900_hid_out_report *)tx_buf;
 
 	tx->nr = 0;
-	tx->cmd = cmd.cmd.cmd;
-	tx->data = cmd.cmd.data;
+	tx->cmd = cmd->cmd.cmd;
+	tx->data = cmd->cmd.data;
+	if (tx_len)
+		memcpy(tx->tail, tx_data, tx_len);
+	tx_len += sizeof(*tx);
 
 	egress = write(fd, tx, tx_len);
-
-	if (is_packet_write)
-		free(tx);
-
 	if (egress < 0)
 		return -errno;
 
 	if ((size_t)egress != tx_len)
 		return -EIO;
 
-	ingress = read(fd, &rx_buf[0], cmd.rsp.len);
+	ingress = read(fd, &rx_buf[0], cmd->rsp.len);
 	if (ingress < 0)
 		return -errno;
 
-	if (ingress != cmd.rsp.len)
+	if (ingress != cmd->rsp.len)
 		return -EIO;
 
-	if (rx_buf[cmd.rsp.len - 1] == DS3900_RSP_BAD)
+	if (rx_buf[cmd->rsp.len - 1] == DS3900_RSP_BAD)
 		return -EBADMSG;
 
-	if (rx_buf[cmd.rsp.len - 1] != cmd.rsp.rsp)
+	if (rx_buf[cmd->rsp.len - 1] != cmd->rsp.rsp)
 		return -EBADE;
 
-	if (buf)
-		memcpy(buf, rx_buf, len);
+	if (rx)
+		memcpy(rx, rx_buf, rx_len);
 
 	return 0;
 }
 
+/* Issue any command other than a packet write, reading the response to @buf */
+int ds3900_xfer(int fd, const struct ds3900_cmd cmd, void *buf, size_t len)
+{
+	if (ds3900_is_packet_write(&cmd))
+		return -EINVAL;
+
+	return ds3900_xfer_buf(fd, &cmd, NULL, 0, buf, len);
+}
+
+/* Issue a packet write carrying the @len bytes of @buf */
+int ds3900_xfer_write(int fd, const struct ds3900_cmd cmd, const void *buf,
+		      size_t len)
+{
+	if (!ds3900_is_packet_write(&cmd))
+		return -EINVAL;
+
+	return ds3900_xfer_buf(fd, &cmd, buf, len, NULL, 0);
+}
+
 int ds3900_packet_device_address(int fd, uint8_t dev)
 {
 	struct ds3900_cmd cmd;
@@ -150,3 +167,233 @@ int ds3900_packet_device_address(int fd, uint8_t dev)
 	cmd.cmd.data = dev << 1;
 	return ds3900_xfer(fd, cmd, NULL, 0);
 }
+
+/*
+ * The DS3900 latches the target address for packet operations, so only issue
+ * the address command when the target actually changes.
+ */
+static int ds3900_bus_set_device(struct ds3900_bus *ctx, uint8_t dev)
+{
+	int rc;
+
+	if (ctx->dev == dev)
+		return 0;
+
+	rc = ds3900_packet_device_address(ctx->fd, dev);
+	if (rc < 0) {
+		ctx->dev = -1;
+		return rc;
+	}
+
+	ctx->dev = dev;
+
+	return 0;
+}
+
+static int ds3900_bus_read(struct smbus *bus, uint8_t dev, uint8_t reg,
+			   void *buf, size_t len)
+{
+	struct ds3900_bus *ctx = container_of(bus, struct ds3900_bus, bus);
+	struct ds3900_cmd cmd;
+	int rc;
+
+	if (!len || len > DS3900_PACKET_MAX)
+		return -EINVAL;
+
+	rc = ds3900_bus_set_device(ctx, dev);
+	if (rc < 0)
+		return rc;
+
+	cmd = ds3900_cmd_packet_read;
+	ds3900_packet_op(&cmd, reg, len);
+	return ds3900_xfer(ctx->fd, cmd, buf, len);
+}
+
+static int ds3900_bus_write(struct smbus *bus, uint8_t dev, uint8_t reg,
+			    const void *buf, size_t len)
+{
+	struct ds3900_bus *ctx = container_of(bus, struct ds3900_bus, bus);
+	struct ds3900_cmd cmd;
+	int rc;
+
+	if (!len || len > DS3900_PACKET_MAX)
+		return -EINVAL;
+
+	rc = ds3900_bus_set_device(ctx, dev);
+	if (rc < 0)
+		return rc;
+
+	cmd = ds3900_cmd_packet_write;
+	ds3900_packet_op(&cmd, reg, len);
+	return ds3900_xfer_write(ctx->fd, cmd, buf, len);
+}
+
+/* Something's wrong with this, all data bytes are 0xff */
+static ssize_t ds3900_bus_read_block(struct smbus *bus, uint8_t dev,
+				     uint8_t reg, uint8_t *buf, size_t len)
+{
+	struct ds3900_bus *ctx = container_of(bus, struct ds3900_bus, bus);
+	struct ds3900_cmd cmd;
+	size_t i, n, want;
+	uint8_t count;
+	int fd;
+	int rc;
+
+	fd = ctx->fd;
+
+	if (!buf && len)
+		return -EINVAL;
+
+	/* Start */
+	rc = ds3900_xfer(fd, ds3900_cmd_2wire_start, NULL, 0);
+	if (rc < 0)
+		return rc;
+
+	/* Address with Write*/
+	cmd = ds3900_cmd_2wire_write_byte;
+	cmd.cmd.data = (dev << 1) | 0;
+	rc = ds3900_xfer(fd, cmd, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Command Code */
+	cmd = ds3900_cmd_2wire_write_byte;
+	cmd.cmd.data = reg;
+	rc = ds3900_xfer(fd, cmd, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Start Repeat */
+	rc = ds3900_xfer(fd, ds3900_cmd_2wire_start, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Address with Read */
+	cmd = ds3900_cmd_2wire_write_byte;
+	cmd.cmd.data = (dev << 1) | 1;
+	rc = ds3900_xfer(fd, cmd, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Count, NACKed if there's no room for anything after it */
+	cmd = ds3900_cmd_2wire_read_byte;
+	cmd.cmd.data = len ? DS3900_CMD_2WIRE_READ_BYTE_ACK :
+			     DS3900_CMD_2WIRE_READ_BYTE_NACK;
+	rc = ds3900_xfer(fd, cmd, &count, sizeof(count));
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/*
+	 * Only clock out what fits in the caller's buffer, NACKing the last
+	 * byte we take to end the transfer early. With PEC enabled the PEC
+	 * byte trails the block.
+	 */
+	want = count + ctx->bus.pec;
+	n = want > len ? len : want;
+	for (i = 0; i < n; i++) {
+		cmd = ds3900_cmd_2wire_read_byte;
+		cmd.cmd.data = i + 1 < n; /* ACK while there's another byte */
+		rc = ds3900_xfer(fd, cmd, &buf[i], sizeof(*buf));
+		if (rc < 0)
+			goto cleanup_bus;
+	}
+
+	/*
+	 * An empty block leaves the ACKed count as the last byte, and the
+	 * target still driving SDA. NACK one more byte so it releases the bus
+	 * before the STOP.
+	 */
+	if (len && !n) {
+		uint8_t discard;
+
+		cmd = ds3900_cmd_2wire_read_byte;
+		cmd.cmd.data = DS3900_CMD_2WIRE_READ_BYTE_NACK;
+		rc = ds3900_xfer(fd, cmd, &discard, sizeof(discard));
+		if (rc < 0)
+			goto cleanup_bus;
+	}
+
+	rc = ds3900_xfer(fd, ds3900_cmd_2wire_stop, NULL, 0);
+	if (!rc)
+		return want > len ? -EOVERFLOW : count;
+
+cleanup_bus:
+	ds3900_xfer(fd, ds3900_cmd_2wire_recover, NULL, 0);
+
+	return rc;
+}
+
+static ssize_t ds3900_bus_write_block(struct smbus *bus, uint8_t dev,
+				      uint8_t reg, const uint8_t *buf,
+				      size_t len)
+{
+	struct ds3900_bus *ctx = container_of(bus, struct ds3900_bus, bus);
+	struct ds3900_cmd cmd;
+	size_t i;
+	int fd;
+	int rc;
+
+	fd = ctx->fd;
+
+	if ((!buf && len) || len > SMBUS_BLOCK_MAX)
+		return -EINVAL;
+
+	/* Start */
+	rc = ds3900_xfer(fd, ds3900_cmd_2wire_start, NULL, 0);
+	if (rc < 0)
+		return rc;
+
+	/* Address with Write */
+	cmd = ds3900_cmd_2wire_write_byte;
+	cmd.cmd.data = (dev << 1) | 0;
+	rc = ds3900_xfer(fd, cmd, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Command Code */
+	cmd = ds3900_cmd_2wire_write_byte;
+	cmd.cmd.data = reg;
+	rc = ds3900_xfer(fd, cmd, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Count */
+	cmd = ds3900_cmd_2wire_write_byte;
+	cmd.cmd.data = len;
+	rc = ds3900_xfer(fd, cmd, NULL, 0);
+	if (rc < 0)
+		goto cleanup_bus;
+
+	/* Write data, and the PEC if enabled */
+	for (i = 0; i < len + ctx->bus.pec; i++) {
+		cmd = ds3900_cmd_2wire_write_byte;
+		cmd.cmd.data = buf[i];
+		rc = ds3900_xfer(fd, cmd, NULL, 0);
+		if (rc < 0)
+			goto cleanup_bus;
+	}
+
+	rc = ds3900_xfer(fd, ds3900_cmd_2wire_stop, NULL, 0);
+	if (!rc)
+		return len;
+
+cleanup_bus:
+	ds3900_xfer(fd, ds3900_cmd_2wire_recover, NULL, 0);
+
+	return rc;
+}
+
+static const struct smbus_ops ds3900_bus_ops = {
+	.read = ds3900_bus_read,
+	.write = ds3900_bus_write,
+	.read_block = ds3900_bus_read_block,
+	.write_block = ds3900_bus_write_block,
+};
+
+void ds3900_bus_init(struct ds3900_bus *ctx, int fd)
+{
+	smbus_init(&ctx->bus, &ds3900_bus_ops);
+	ctx->bus.quirks = SMBUS_QUIRK_BAD_READ_BLOCK;
+	ctx->fd = fd;
+	ctx->dev = -1;
+}
@@ -1,11 +1,19 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 /* Copyright (C) 2020 IBM Corp. */
 
+#ifndef DS3900_H
+#define DS3900_H
+
+#include "smbus.h"
+
 #include <stdint.h>
 #include <sys/types.h>
 
 #define DS3900_RSP_BAD	0xfa
 
+/* Packet operations encode the length minus one in four bits */
+#define DS3900_PACKET_MAX	16
+
 struct ds3900_cmd {
 	struct {
 		uint8_t cmd;
@@ -34,4 +42,17 @@ extern const struct ds3900_cmd ds3900_cmd_read_revision;
 
 void ds3900_packet_op(struct ds3900_cmd *cmd, uint8_t reg, uint8_t len);
 int ds3900_xfer(int fd, const struct ds3900_cmd cmd, void *buf, size_t len);
+int ds3900_xfer_write(int fd, const struct ds3900_cmd cmd, const void *buf,
+		      size_t len);
 int ds3900_packet_device_address(int fd, uint8_t dev);
+
+/* SMBus transport over the DS3900 HID interface */
+struct ds3900_bus {
+	struct smbus bus;
+	int fd;
+	int dev;	/* Current packet device address, -1 if unknown */
+};
+
+void ds3900_bus_init(struct ds3900_bus *ctx, int fd);
+
+#endif
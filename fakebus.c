@@ -0,0 +1,169 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "fakebus.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Returns the length of the register data, excluding any PEC byte */
+static int fake_bus_check(struct fake_bus *ctx, uint8_t dev, size_t len)
+{
+	if (dev != ctx->addr)
+		return -ENXIO;
+
+	if (ctx->bus.pec)
+		len--;
+
+	if (!len || len > 2)
+		return -EINVAL;
+
+	return len;
+}
+
+static void fake_bus_load(struct fake_bus *ctx, uint8_t reg, uint8_t *buf,
+			  size_t len)
+{
+	const uint8_t start[] = { ctx->addr << 1, reg, (ctx->addr << 1) | 1 };
+	uint16_t val;
+
+	if (reg == PMBUS_PAGE)
+		val = ctx->page;
+	else if (ctx->page == PMBUS_PAGE_ALL)
+		val = ctx->regs[0][reg];
+	else
+		val = ctx->regs[ctx->page % PMBUS_PAGES][reg];
+
+	buf[0] = val & 0xff;
+	if (len > 1)
+		buf[1] = val >> 8;
+
+	if (ctx->bus.pec)
+		buf[len] = smbus_pec_update(smbus_pec_update(0, start,
+							     sizeof(start)),
+					    buf, len);
+}
+
+static void fake_bus_corrupt(struct fake_bus *ctx, uint8_t *buf)
+{
+	if (ctx->corrupt && ctx->xfers >= ctx->corrupt &&
+	    ctx->xfers - ctx->corrupt < ctx->ncorrupt)
+		buf[0] ^= 0x01;
+}
+
+static int fake_bus_store(struct fake_bus *ctx, uint8_t reg,
+			  const uint8_t *buf, size_t len)
+{
+	const uint8_t start[] = { ctx->addr << 1, reg };
+	uint16_t val;
+	size_t page;
+
+	if (ctx->bus.pec &&
+	    smbus_pec_update(smbus_pec_update(0, start, sizeof(start)),
+			     buf, len) != buf[len])
+		return -EIO;
+
+	val = buf[0];
+	if (len > 1)
+		val |= buf[1] << 8;
+
+	if (reg == PMBUS_PAGE) {
+		ctx->page = val;
+		ctx->page_writes++;
+		return 0;
+	}
+
+	if (ctx->page != PMBUS_PAGE_ALL) {
+		ctx->regs[ctx->page % PMBUS_PAGES][reg] = val;
+		return 0;
+	}
+
+	for (page = 0; page < PMBUS_PAGES; page++)
+		ctx->regs[page][reg] = val;
+
+	return 0;
+}
+
+static int fake_bus_read(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 void *buf, size_t len)
+{
+	struct fake_bus *ctx = container_of(bus, struct fake_bus, bus);
+	int rc;
+
+	ctx->xfers++;
+
+	rc = fake_bus_check(ctx, dev, len);
+	if (rc < 0)
+		return rc;
+
+	fake_bus_load(ctx, reg, buf, rc);
+	fake_bus_corrupt(ctx, buf);
+
+	return 0;
+}
+
+static int fake_bus_write(struct smbus *bus, uint8_t dev, uint8_t reg,
+			  const void *buf, size_t len)
+{
+	struct fake_bus *ctx = container_of(bus, struct fake_bus, bus);
+	int rc;
+
+	ctx->xfers++;
+
+	rc = fake_bus_check(ctx, dev, len);
+	if (rc < 0)
+		return rc;
+
+	return fake_bus_store(ctx, reg, buf, rc);
+}
+
+static int fake_bus_paged_read(struct smbus *bus, uint8_t dev,
+			       uint8_t page_reg, const void *page,
+			       size_t page_len, uint8_t reg, void *buf,
+			       size_t len)
+{
+	struct fake_bus *ctx = container_of(bus, struct fake_bus, bus);
+	int rc;
+
+	ctx->xfers++;
+	ctx->paged_reads++;
+
+	/* Combined transfers carry no PEC */
+	if (ctx->bus.pec)
+		return -EPROTO;
+
+	rc = fake_bus_check(ctx, dev, len);
+	if (rc < 0)
+		return rc;
+
+	if (page_reg != PMBUS_PAGE || page_len != 1)
+		return -EINVAL;
+
+	rc = fake_bus_store(ctx, page_reg, page, page_len);
+	if (rc < 0)
+		return rc;
+
+	fake_bus_load(ctx, reg, buf, len);
+	fake_bus_corrupt(ctx, buf);
+
+	return 0;
+}
+
+static const struct smbus_ops fake_bus_ops = {
+	.read = fake_bus_read,
+	.write = fake_bus_write,
+};
+
+static const struct smbus_ops fake_bus_paged_ops = {
+	.read = fake_bus_read,
+	.write = fake_bus_write,
+	.paged_read = fake_bus_paged_read,
+};
+
+void fake_bus_init(struct fake_bus *ctx, uint8_t addr, bool paged_read)
+{
+	memset(ctx, 0, sizeof(*ctx));
+	smbus_init(&ctx->bus, paged_read ? &fake_bus_paged_ops : &fake_bus_ops);
+	ctx->addr = addr;
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef FAKEBUS_H
+#define FAKEBUS_H
+
+#include "pmbus.h"
+#include "smbus.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * SMBus transport backed by an in-memory PMBus target at a single address.
+ * Each register is a 16-bit value per page that byte accesses see the low
+ * half of. PAGE selects a page, or with PMBUS_PAGE_ALL writes go to every
+ * page. Every call into the transport counts as one transfer. With PEC
+ * enabled reads carry a PEC and writes must, and combined PAGE+read transfers
+ * are refused. Setting @corrupt flips a bit in the responses to @ncorrupt
+ * transfers starting with transfer number @corrupt, counting from one.
+ */
+struct fake_bus {
+	struct smbus bus;
+	uint8_t addr;
+	uint8_t page;
+	uint16_t regs[PMBUS_PAGES][256];
+	unsigned long xfers;
+	unsigned long page_writes;
+	unsigned long paged_reads;
+	unsigned long corrupt;
+	unsigned long ncorrupt;
+};
+
+void fake_bus_init(struct fake_bus *ctx, uint8_t addr, bool paged_read);
+
+#endif
@@ -0,0 +1,174 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "i2cdev.h"
+
+#include <errno.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include <string.h>
+#include <sys/ioctl.h>
+
+/* Command code plus the largest SMBus block and its PEC */
+#define I2CDEV_MSG_MAX	(2 + SMBUS_BLOCK_MAX)
+
+static int i2cdev_rdwr(struct i2cdev_bus *ctx, struct i2c_msg *msgs,
+		       size_t nmsgs)
+{
+	struct i2c_rdwr_ioctl_data data = {
+		.msgs = msgs,
+		.nmsgs = nmsgs,
+	};
+	int rc;
+
+	rc = ioctl(ctx->fd, I2C_RDWR, &data);
+	if (rc < 0)
+		return -errno;
+
+	if ((size_t)rc != nmsgs)
+		return -EIO;
+
+	return 0;
+}
+
+static int i2cdev_bus_read(struct smbus *bus, uint8_t dev, uint8_t reg,
+			   void *buf, size_t len)
+{
+	struct i2cdev_bus *ctx = container_of(bus, struct i2cdev_bus, bus);
+	struct i2c_msg msgs[] = {
+		{ .addr = dev, .flags = 0, .len = 1, .buf = &reg },
+		{ .addr = dev, .flags = I2C_M_RD, .len = len, .buf = buf },
+	};
+
+	if (!len || len > SMBUS_BLOCK_MAX + 1)
+		return -EINVAL;
+
+	return i2cdev_rdwr(ctx, msgs, ARRAY_SIZE(msgs));
+}
+
+static int i2cdev_bus_write(struct smbus *bus, uint8_t dev, uint8_t reg,
+			    const void *buf, size_t len)
+{
+	struct i2cdev_bus *ctx = container_of(bus, struct i2cdev_bus, bus);
+	uint8_t tx[I2CDEV_MSG_MAX];
+	struct i2c_msg msg = {
+		.addr = dev, .flags = 0, .len = len + 1, .buf = tx,
+	};
+
+	if (!len || len > SMBUS_BLOCK_MAX + 1)
+		return -EINVAL;
+
+	tx[0] = reg;
+	memcpy(&tx[1], buf, len);
+
+	return i2cdev_rdwr(ctx, &msg, 1);
+}
+
+/*
+ * Issue the PAGE write, command code and data read as one combined transfer,
+ * separated by repeated starts rather than stops.
+ */
+static int i2cdev_bus_paged_read(struct smbus *bus, uint8_t dev,
+				 uint8_t page_reg, const void *page,
+				 size_t page_len, uint8_t reg, void *buf,
+				 size_t len)
+{
+	struct i2cdev_bus *ctx = container_of(bus, struct i2cdev_bus, bus);
+	uint8_t page_tx[3] = { page_reg };
+	struct i2c_msg msgs[] = {
+		{ .addr = dev, .flags = 0, .len = 1 + page_len, .buf = page_tx },
+		{ .addr = dev, .flags = 0, .len = 1, .buf = &reg },
+		{ .addr = dev, .flags = I2C_M_RD, .len = len, .buf = buf },
+	};
+
+	if (!page_len || page_len > sizeof(page_tx) - 1)
+		return -EINVAL;
+
+	if (!len || len > SMBUS_BLOCK_MAX + 1)
+		return -EINVAL;
+
+	memcpy(&page_tx[1], page, page_len);
+
+	return i2cdev_rdwr(ctx, msgs, ARRAY_SIZE(msgs));
+}
+
+/*
+ * I2C_M_RECV_LEN has the adapter take the transfer length from the first byte
+ * received. On entry buf[0] holds the number of bytes expected beyond the
+ * block data: the count byte itself, and the PEC if enabled.
+ */
+static ssize_t i2cdev_bus_read_block(struct smbus *bus, uint8_t dev,
+				     uint8_t reg, uint8_t *buf, size_t len)
+{
+	struct i2cdev_bus *ctx = container_of(bus, struct i2cdev_bus, bus);
+	uint8_t rx[I2CDEV_MSG_MAX] = { 1 + bus->pec };
+	struct i2c_msg msgs[] = {
+		{ .addr = dev, .flags = 0, .len = 1, .buf = &reg },
+		{
+			.addr = dev,
+			.flags = I2C_M_RD | I2C_M_RECV_LEN,
+			.len = sizeof(rx),
+			.buf = rx,
+		},
+	};
+	uint8_t count;
+	int rc;
+
+	if (!buf && len)
+		return -EINVAL;
+
+	rc = i2cdev_rdwr(ctx, msgs, ARRAY_SIZE(msgs));
+	if (rc < 0)
+		return rc;
+
+	count = rx[0];
+	if (count > SMBUS_BLOCK_MAX)
+		return -EPROTO;
+
+	if ((size_t)count + bus->pec > len)
+		return -EOVERFLOW;
+
+	memcpy(buf, &rx[1], count + bus->pec);
+
+	return count;
+}
+
+static ssize_t i2cdev_bus_write_block(struct smbus *bus, uint8_t dev,
+				      uint8_t reg, const uint8_t *buf,
+				      size_t len)
+{
+	struct i2cdev_bus *ctx = container_of(bus, struct i2cdev_bus, bus);
+	uint8_t tx[1 + I2CDEV_MSG_MAX];
+	struct i2c_msg msg = {
+		.addr = dev, .flags = 0, .len = len + 2 + bus->pec, .buf = tx,
+	};
+	int rc;
+
+	if ((!buf && len) || len > SMBUS_BLOCK_MAX)
+		return -EINVAL;
+
+	tx[0] = reg;
+	tx[1] = len;
+	memcpy(&tx[2], buf, len + bus->pec);
+
+	rc = i2cdev_rdwr(ctx, &msg, 1);
+	if (rc < 0)
+		return rc;
+
+	return len;
+}
+
+static const struct smbus_ops i2cdev_bus_ops = {
+	.read = i2cdev_bus_read,
+	.write = i2cdev_bus_write,
+	.paged_read = i2cdev_bus_paged_read,
+	.read_block = i2cdev_bus_read_block,
+	.write_block = i2cdev_bus_write_block,
+};
+
+void i2cdev_bus_init(struct i2cdev_bus *ctx, int fd)
+{
+	smbus_init(&ctx->bus, &i2cdev_bus_ops);
+	ctx->fd = fd;
+}
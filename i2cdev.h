@@ -0,0 +1,17 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef I2CDEV_H
+#define I2CDEV_H
+
+#include "smbus.h"
+
+/* SMBus transport over a Linux /dev/i2c-N adapter */
+struct i2cdev_bus {
+	struct smbus bus;
+	int fd;
+};
+
+void i2cdev_bus_init(struct i2cdev_bus *ctx, int fd);
+
+#endif
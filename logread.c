@@ -0,0 +1,95 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "tslog.h"
+
+#include <ctype.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static void help(const char *name)
+{
+	fprintf(stderr, "USAGE: %s LOG [FROM [TO]]\n", name);
+}
+
+/* Parsed by hand, as a double can't hold a wall clock time to the microsecond */
+static int parse_time(const char *arg, int64_t *t_us)
+{
+	int64_t scale = 100000;
+	long long sec;
+	char *end;
+
+	sec = strtoll(arg, &end, 10);
+	if (end == arg || arg[0] == '-')
+		return -1;
+
+	*t_us = sec * 1000000;
+	if (*end == '.') {
+		for (end++; isdigit((unsigned char)*end); end++) {
+			*t_us += (*end - '0') * scale;
+			scale /= 10;
+		}
+	}
+
+	return *end ? -1 : 0;
+}
+
+/* Print the samples of a log between FROM and TO seconds as CSV */
+int main(int argc, char *argv[])
+{
+	uint16_t vals[TSLOG_SERIES_MAX];
+	struct tslog_reader r;
+	int64_t from, to, t_us;
+	size_t i;
+	int rc;
+
+	if (argc < 2) {
+		help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	from = INT64_MIN;
+	to = INT64_MAX;
+	if ((argc > 2 && parse_time(argv[2], &from)) ||
+	    (argc > 3 && parse_time(argv[3], &to))) {
+		help(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
+	rc = tslog_reader_open(&r, argv[1]);
+	if (rc < 0) {
+		fprintf(stderr, "Failed to open %s: %s\n", argv[1], strerror(-rc));
+		exit(EXIT_FAILURE);
+	}
+
+	rc = tslog_reader_seek(&r, from);
+	if (rc < 0)
+		goto cleanup_reader;
+
+	printf("time");
+	for (i = 0; i < r.nseries; i++)
+		printf(",0x%02x/%u", r.series[i].addr, r.series[i].page);
+	printf("\n");
+
+	while ((rc = tslog_reader_next(&r, &t_us, vals)) > 0) {
+		if (t_us > to)
+			break;
+
+		printf("%" PRId64 ".%06" PRId64, t_us / 1000000, t_us % 1000000);
+		for (i = 0; i < r.nseries; i++)
+			printf(",%u", vals[i]);
+		printf("\n");
+	}
+
+cleanup_reader:
+	tslog_reader_close(&r);
+
+	if (rc < 0) {
+		fprintf(stderr, "Failed to read %s: %s\n", argv[1], strerror(-rc));
+		exit(EXIT_FAILURE);
+	}
+
+	return 0;
+}
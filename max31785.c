@@ -0,0 +1,340 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "max31785.h"
+#include "pmbus.h"
+#include "smbus.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <string.h>
+
+#define FAN	MAX31785_PAGE_FAN, MAX31785_PAGE_TEMP - 1
+#define TEMP	MAX31785_PAGE_TEMP, MAX31785_PAGE_ADC - 1
+#define ADC	MAX31785_PAGE_ADC, MAX31785_PAGES - 1
+#define ALL	0, MAX31785_PAGES - 1
+#define GLOBAL	0, 0
+
+#define G	MAX31785_REG_GLOBAL
+#define W	MAX31785_REG_WRITABLE
+#define B	MAX31785_REG_BLOCK
+
+/*
+ * Sorted by command code. WRITE_PROTECT is deliberately not restored as it
+ * would block the writes that follow it. MFR_NV_FAULT_LOG is omitted as it
+ * exceeds the SMBus block limit.
+ */
+const struct max31785_reg max31785_regs[] = {
+	{ "WRITE_PROTECT", PMBUS_WRITE_PROTECT, 1, GLOBAL, G },
+	{ "CAPABILITY", PMBUS_CAPABILITY, 1, GLOBAL, G },
+	{ "VOUT_MODE", PMBUS_VOUT_MODE, 1, ADC, 0 },
+	{ "VOUT_SCALE_MONITOR", PMBUS_VOUT_SCALE_MONITOR, 2, ADC, W },
+	{ "FAN_CONFIG_12", PMBUS_FAN_CONFIG_12, 1, FAN, W },
+	{ "FAN_COMMAND_1", PMBUS_FAN_COMMAND_1, 2, FAN, W },
+	{ "VOUT_OV_FAULT_LIMIT", PMBUS_VOUT_OV_FAULT_LIMIT, 2, ADC, W },
+	{ "VOUT_OV_WARN_LIMIT", PMBUS_VOUT_OV_WARN_LIMIT, 2, ADC, W },
+	{ "VOUT_UV_WARN_LIMIT", PMBUS_VOUT_UV_WARN_LIMIT, 2, ADC, W },
+	{ "VOUT_UV_FAULT_LIMIT", PMBUS_VOUT_UV_FAULT_LIMIT, 2, ADC, W },
+	{ "OT_FAULT_LIMIT", PMBUS_OT_FAULT_LIMIT, 2, TEMP, W },
+	{ "OT_WARN_LIMIT", PMBUS_OT_WARN_LIMIT, 2, TEMP, W },
+	{ "STATUS_BYTE", PMBUS_STATUS_BYTE, 1, ALL, 0 },
+	{ "STATUS_WORD", PMBUS_STATUS_WORD, 2, ALL, 0 },
+	{ "STATUS_VOUT", PMBUS_STATUS_VOUT, 1, ADC, 0 },
+	{ "STATUS_CML", PMBUS_STATUS_CML, 1, GLOBAL, G },
+	{ "STATUS_MFR_SPECIFIC", PMBUS_STATUS_MFR_SPECIFIC, 1, TEMP, 0 },
+	{ "STATUS_FANS_12", PMBUS_STATUS_FANS_12, 1, FAN, 0 },
+	{ "READ_VOUT", PMBUS_READ_VOUT, 2, ADC, 0 },
+	{ "READ_TEMPERATURE_1", PMBUS_READ_TEMPERATURE_1, 2, TEMP, 0 },
+	{ "READ_FAN_SPEED_1", PMBUS_READ_FAN_SPEED_1, 2, FAN, 0 },
+	{ "PMBUS_REVISION", PMBUS_REVISION, 1, GLOBAL, G },
+	{ "MFR_ID", PMBUS_MFR_ID, SMBUS_BLOCK_MAX, GLOBAL, G | B },
+	{ "MFR_MODEL", PMBUS_MFR_MODEL, SMBUS_BLOCK_MAX, GLOBAL, G | B },
+	{ "MFR_REVISION", PMBUS_MFR_REVISION, 2, GLOBAL, G },
+	{ "MFR_LOCATION", PMBUS_MFR_LOCATION, 8, GLOBAL, G | W | B },
+	{ "MFR_DATE", PMBUS_MFR_DATE, 8, GLOBAL, G | W | B },
+	{ "MFR_SERIAL", PMBUS_MFR_SERIAL, 8, GLOBAL, G | W | B },
+	{ "MFR_MODE", MAX31785_MFR_MODE, 2, GLOBAL, G | W },
+	{ "MFR_VOUT_PEAK", MAX31785_MFR_VOUT_PEAK, 2, ADC, 0 },
+	{ "MFR_TEMPERATURE_PEAK", MAX31785_MFR_TEMPERATURE_PEAK, 2, TEMP, 0 },
+	{ "MFR_VOUT_MIN", MAX31785_MFR_VOUT_MIN, 2, ADC, 0 },
+	{ "MFR_FAULT_RESPONSE", MAX31785_MFR_FAULT_RESPONSE, 1, ALL, W },
+	{ "MFR_TIME_COUNT", MAX31785_MFR_TIME_COUNT, 4, GLOBAL, G | B },
+	{ "MFR_TEMP_SENSOR_CONFIG", MAX31785_MFR_TEMP_SENSOR_CONFIG, 2, TEMP, W },
+	{ "MFR_FAN_CONFIG", MAX31785_MFR_FAN_CONFIG, 2, FAN, W },
+	{ "MFR_FAN_LUT", MAX31785_MFR_FAN_LUT, 32, FAN, W | B },
+	{ "MFR_READ_FAN_PWM", MAX31785_MFR_READ_FAN_PWM, 2, FAN, 0 },
+	{ "MFR_FAN_FAULT_LIMIT", MAX31785_MFR_FAN_FAULT_LIMIT, 2, FAN, W },
+	{ "MFR_FAN_WARN_LIMIT", MAX31785_MFR_FAN_WARN_LIMIT, 2, FAN, W },
+	{ "MFR_FAN_RUN_TIME", MAX31785_MFR_FAN_RUN_TIME, 2, FAN, 0 },
+	{ "MFR_FAN_PWM_AVG", MAX31785_MFR_FAN_PWM_AVG, 2, FAN, 0 },
+	{ "MFR_FAN_PWM2RPM", MAX31785_MFR_FAN_PWM2RPM, 8, FAN, W | B },
+};
+
+const size_t max31785_nr_regs = ARRAY_SIZE(max31785_regs);
+
+/*
+ * DIRECT format coefficients from the datasheet. The fan command and limits
+ * are in RPM or hundredths of a percent of duty depending on the fan mode.
+ */
+static const struct decode_coeff max31785_coeff_vout = {
+	decode_direct, true, 1, 0, 3, "V",
+};
+
+static const struct decode_coeff max31785_coeff_temp = {
+	decode_direct, true, 1, 0, 2, "C",
+};
+
+static const struct decode_coeff max31785_coeff_pwm = {
+	decode_direct, true, 1, 0, 2, "%",
+};
+
+static const struct decode_coeff max31785_coeff_rpm = {
+	decode_direct, true, 1, 0, 0, "RPM",
+};
+
+static const struct decode_coeff max31785_coeff_speed = {
+	decode_direct, false, 1, 0, 0, "RPM",
+};
+
+static const struct decode_coeff max31785_coeff_scale = {
+	decode_direct, false, 32767, 0, 0, "",
+};
+
+static const struct decode_coeff max31785_coeff_hours = {
+	decode_direct, false, 1, 0, 0, "h",
+};
+
+/* Returns NULL for registers that don't hold a measurement or a limit */
+const struct decode_coeff *max31785_reg_coeff(uint8_t reg, bool rpm)
+{
+	switch (reg) {
+		case PMBUS_VOUT_SCALE_MONITOR:
+			return &max31785_coeff_scale;
+		case PMBUS_VOUT_OV_FAULT_LIMIT:
+		case PMBUS_VOUT_OV_WARN_LIMIT:
+		case PMBUS_VOUT_UV_WARN_LIMIT:
+		case PMBUS_VOUT_UV_FAULT_LIMIT:
+		case PMBUS_READ_VOUT:
+		case MAX31785_MFR_VOUT_PEAK:
+		case MAX31785_MFR_VOUT_MIN:
+			return &max31785_coeff_vout;
+		case PMBUS_OT_FAULT_LIMIT:
+		case PMBUS_OT_WARN_LIMIT:
+		case PMBUS_READ_TEMPERATURE_1:
+		case MAX31785_MFR_TEMPERATURE_PEAK:
+			return &max31785_coeff_temp;
+		case PMBUS_FAN_COMMAND_1:
+		case MAX31785_MFR_FAN_FAULT_LIMIT:
+		case MAX31785_MFR_FAN_WARN_LIMIT:
+			return rpm ? &max31785_coeff_rpm : &max31785_coeff_pwm;
+		case PMBUS_READ_FAN_SPEED_1:
+			return &max31785_coeff_speed;
+		case MAX31785_MFR_READ_FAN_PWM:
+		case MAX31785_MFR_FAN_PWM_AVG:
+			return &max31785_coeff_pwm;
+		case MAX31785_MFR_FAN_RUN_TIME:
+			return &max31785_coeff_hours;
+	}
+
+	return NULL;
+}
+
+static bool max31785_reg_on_page(const struct max31785_reg *r, uint8_t page)
+{
+	if (r->flags & MAX31785_REG_GLOBAL)
+		return page == 0;
+
+	return page >= r->first && page <= r->last;
+}
+
+const struct max31785_reg *max31785_reg_lookup(uint8_t page, uint8_t reg)
+{
+	size_t i;
+
+	for (i = 0; i < max31785_nr_regs; i++) {
+		const struct max31785_reg *r = &max31785_regs[i];
+
+		if (r->reg != reg)
+			continue;
+
+		if ((r->flags & MAX31785_REG_GLOBAL) || max31785_reg_on_page(r, page))
+			return r;
+	}
+
+	return NULL;
+}
+
+/* The largest image max31785_dump() can produce */
+size_t max31785_image_size(void)
+{
+	size_t i, len;
+	uint8_t page;
+
+	len = MAX31785_IMAGE_HDR_LEN;
+	for (page = 0; page < MAX31785_PAGES; page++) {
+		for (i = 0; i < max31785_nr_regs; i++) {
+			if (max31785_reg_on_page(&max31785_regs[i], page))
+				len += 3 + max31785_regs[i].width;
+		}
+	}
+
+	return len;
+}
+
+static ssize_t max31785_dump_reg(struct pmbus_dev *dev, uint8_t page,
+				 const struct max31785_reg *r, uint8_t *data)
+{
+	uint16_t val;
+	int rc;
+
+	if (r->flags & MAX31785_REG_BLOCK) {
+		/* Keep corrupt data out of images, as restore would write it back */
+		if (dev->bus->quirks & SMBUS_QUIRK_BAD_READ_BLOCK)
+			return -EOPNOTSUPP;
+
+		return pmbus_read_block(dev, page, r->reg, data, r->width);
+	}
+
+	if (r->width == 1) {
+		rc = pmbus_read_byte(dev, page, r->reg);
+		if (rc < 0)
+			return rc;
+
+		data[0] = rc;
+		return 1;
+	}
+
+	rc = pmbus_read_word(dev, page, r->reg);
+	if (rc < 0)
+		return rc;
+
+	val = htole16(rc);
+	memcpy(data, &val, sizeof(val));
+
+	return sizeof(val);
+}
+
+/*
+ * Walk the register map one page at a time, so the image costs one PAGE write
+ * per page. Registers that fail to read are left out of the image and passed
+ * to @skip with the error. Returns the length of the image.
+ */
+ssize_t max31785_dump(struct pmbus_dev *dev, uint8_t *buf, size_t len,
+		      void (*skip)(void *arg, uint8_t page,
+				   const struct max31785_reg *r, int err),
+		      void *arg)
+{
+	uint16_t nentries;
+	uint8_t page;
+	size_t off, i;
+	ssize_t rc;
+
+	if (len < max31785_image_size())
+		return -ENOSPC;
+
+	nentries = 0;
+	off = MAX31785_IMAGE_HDR_LEN;
+	for (page = 0; page < MAX31785_PAGES; page++) {
+		for (i = 0; i < max31785_nr_regs; i++) {
+			const struct max31785_reg *r = &max31785_regs[i];
+
+			if (!max31785_reg_on_page(r, page))
+				continue;
+
+			rc = max31785_dump_reg(dev, page, r, &buf[off + 3]);
+			if (rc < 0) {
+				skip(arg, page, r, rc);
+				continue;
+			}
+
+			buf[off] = page;
+			buf[off + 1] = r->reg;
+			buf[off + 2] = rc;
+			off += 3 + rc;
+			nentries++;
+		}
+	}
+
+	memcpy(buf, MAX31785_IMAGE_MAGIC, 4);
+	buf[4] = MAX31785_IMAGE_VERSION;
+	buf[5] = dev->addr;
+	buf[6] = nentries & 0xff;
+	buf[7] = nentries >> 8;
+
+	return off;
+}
+
+static int max31785_restore_reg(struct pmbus_dev *dev, uint8_t page,
+				const struct max31785_reg *r,
+				const uint8_t *data, uint8_t len)
+{
+	ssize_t rc;
+
+	if (r->flags & MAX31785_REG_BLOCK) {
+		rc = pmbus_write_block(dev, page, r->reg, data, len);
+		return rc < 0 ? rc : 0;
+	}
+
+	if (len != r->width)
+		return -EINVAL;
+
+	if (len == 1)
+		return pmbus_write_byte(dev, page, r->reg, data[0]);
+
+	return pmbus_write_word(dev, page, r->reg, data[0] | data[1] << 8);
+}
+
+/*
+ * Write the writable registers of an image back to the device in image
+ * order, which is page order for images produced by max31785_dump(). An
+ * image taken from a device at another address is refused with
+ * -EADDRNOTAVAIL unless @force is set. Returns the length of the image
+ * consumed from @buf.
+ */
+ssize_t max31785_restore(struct pmbus_dev *dev, const uint8_t *buf,
+			 size_t len, bool force, size_t *written)
+{
+	uint16_t nentries, i;
+	size_t off;
+	int rc;
+
+	if (len < MAX31785_IMAGE_HDR_LEN)
+		return -EINVAL;
+
+	if (memcmp(buf, MAX31785_IMAGE_MAGIC, 4) ||
+	    buf[4] != MAX31785_IMAGE_VERSION)
+		return -EINVAL;
+
+	if (buf[5] != dev->addr && !force)
+		return -EADDRNOTAVAIL;
+
+	nentries = buf[6] | buf[7] << 8;
+
+	*written = 0;
+	off = MAX31785_IMAGE_HDR_LEN;
+	for (i = 0; i < nentries; i++) {
+		const struct max31785_reg *r;
+		uint8_t page, reg, n;
+
+		if (len - off < 3 || len - off - 3 < buf[off + 2])
+			return -EINVAL;
+
+		page = buf[off];
+		reg = buf[off + 1];
+		n = buf[off + 2];
+
+		r = max31785_reg_lookup(page, reg);
+		if (r && (r->flags & MAX31785_REG_WRITABLE)) {
+			rc = max31785_restore_reg(dev, page, r, &buf[off + 3], n);
+			if (rc < 0)
+				return rc;
+
+			(*written)++;
+		}
+
+		off += 3 + n;
+	}
+
+	return off;
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef MAX31785_H
+#define MAX31785_H
+
+#include "bits.h"
+#include "decode.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct pmbus_dev;
+
+/* Pages 0-5 are fans, 6-16 temperature sensors and 17-22 ADC inputs */
+#define MAX31785_PAGES			23
+#define MAX31785_PAGE_FAN		0
+#define MAX31785_PAGE_TEMP		6
+#define MAX31785_PAGE_ADC		17
+
+#define MAX31785_MFR_MODE		0xd1
+#define MAX31785_MFR_VOUT_PEAK		0xd4
+#define MAX31785_MFR_TEMPERATURE_PEAK	0xd6
+#define MAX31785_MFR_VOUT_MIN		0xd7
+#define MAX31785_MFR_FAULT_RESPONSE	0xd9
+#define MAX31785_MFR_TIME_COUNT		0xdd
+#define MAX31785_MFR_TEMP_SENSOR_CONFIG	0xf0
+#define MAX31785_MFR_FAN_CONFIG		0xf1
+#define MAX31785_MFR_FAN_LUT		0xf2
+#define MAX31785_MFR_READ_FAN_PWM	0xf3
+#define MAX31785_MFR_FAN_FAULT_LIMIT	0xf5
+#define MAX31785_MFR_FAN_WARN_LIMIT	0xf6
+#define MAX31785_MFR_FAN_RUN_TIME	0xf7
+#define MAX31785_MFR_FAN_PWM_AVG	0xf8
+#define MAX31785_MFR_FAN_PWM2RPM	0xf9
+
+#define MAX31785_REG_GLOBAL		BIT(0)	/* Shared by all pages */
+#define MAX31785_REG_WRITABLE		BIT(1)	/* Restored from images */
+#define MAX31785_REG_BLOCK		BIT(2)	/* SMBus block access */
+
+struct max31785_reg {
+	const char *name;
+	uint8_t reg;
+	uint8_t width;		/* In bytes, the maximum length for blocks */
+	uint8_t first;		/* Page range, ignored for global registers */
+	uint8_t last;
+	uint8_t flags;
+};
+
+extern const struct max31785_reg max31785_regs[];
+extern const size_t max31785_nr_regs;
+
+const struct max31785_reg *max31785_reg_lookup(uint8_t page, uint8_t reg);
+const struct decode_coeff *max31785_reg_coeff(uint8_t reg, bool rpm);
+
+/*
+ * Register images start with an 8-byte header: the "MX85" magic, a version
+ * byte, the device address and a little-endian 16-bit entry count. Each
+ * entry is a page, a register, a length byte and the register data as
+ * transferred on the bus.
+ */
+#define MAX31785_IMAGE_MAGIC		"MX85"
+#define MAX31785_IMAGE_VERSION		1
+#define MAX31785_IMAGE_HDR_LEN		8
+
+size_t max31785_image_size(void);
+ssize_t max31785_dump(struct pmbus_dev *dev, uint8_t *buf, size_t len,
+		      void (*skip)(void *arg, uint8_t page,
+				   const struct max31785_reg *r, int err),
+		      void *arg);
+ssize_t max31785_restore(struct pmbus_dev *dev, const uint8_t *buf,
+			 size_t len, bool force, size_t *written);
+
+#endif
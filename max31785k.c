@@ -2,13 +2,23 @@
 // Copyright (C) 2020 IBM Corp.
 
 #include "ds3900.h"
+#include "i2cdev.h"
+#include "max31785.h"
+#include "metrics.h"
+#include "plan.h"
 #include "pmbus.h"
+#include "profile.h"
 #include "smbus.h"
+#include "state.h"
+#include "telemetry.h"
+#include "tslog.h"
+#include "watch.h"
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -16,30 +26,26 @@
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
-static int do_ds3900_get(int fd, int dev, int reg, size_t width)
+#define MAX31785K_DEVICES_MAX	16
+#define MAX31785K_PROFILE_SAMPLES	4096
+
+static int do_ds3900_get(struct smbus *bus, int dev, int reg, size_t width)
 {
-	uint8_t *data = NULL;
+	uint8_t data[SMBUS_BLOCK_MAX];
 	ssize_t rc;
 
 	switch (width) {
 		case 0:
-			rc = smbus_read_block(fd, dev, reg, &data, 0);
+			rc = smbus_read_block(bus, dev, reg, data, sizeof(data));
 			break;
 		case 1:
-			rc = ds3900_packet_device_address(fd, dev);
-			if (rc < 0)
-				return rc;
-
-			rc = smbus_read_byte(fd, reg);
+			rc = smbus_read_byte(bus, dev, reg);
 			break;
 		case 2:
-			rc = ds3900_packet_device_address(fd, dev);
-			if (rc < 0)
-				return rc;
-
-			rc = smbus_read_word(fd, reg);
+			rc = smbus_read_word(bus, dev, reg);
 			break;
 		default:
 			return -EINVAL;
@@ -57,9 +63,6 @@ static int do_ds3900_get(int fd, int dev, int reg, size_t width)
 	} else {
 		int i;
 
-		if (!data)
-			return 0;
-
 		i = 0;
 		while (i < rc) {
 			int j;
@@ -77,24 +80,17 @@ static int do_ds3900_get(int fd, int dev, int reg, size_t width)
 	return 0;
 }
 
-static int do_ds3900_set(int fd, int dev, int reg, int val, size_t width)
+static int do_ds3900_set(struct smbus *bus, int dev, int reg, int val,
+			 size_t width)
 {
 	int rc;
 
 	switch (width) {
 		case 1:
-			rc = ds3900_packet_device_address(fd, dev);
-			if (rc < 0)
-				return rc;
-
-			rc = smbus_write_byte(fd, reg, val);
+			rc = smbus_write_byte(bus, dev, reg, val);
 			break;
 		case 2:
-			rc = ds3900_packet_device_address(fd, dev);
-			if (rc < 0)
-				return rc;
-
-			rc = smbus_write_word(fd, reg, val);
+			rc = smbus_write_word(bus, dev, reg, val);
 			break;
 		default:
 			return -EINVAL;
@@ -141,25 +137,791 @@ static int smbus_parse_width(const char *width)
 	}
 }
 
+static int do_fan_speed_get(struct pmbus_dev *dev, int page, int fan)
+{
+	const struct decode_coeff *coeff;
+	enum pmbus_fan_mode mode;
+	float rate;
+	int rc;
+
+	rc = pmbus_fan_config_get_enabled(dev, page, fan);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_fan_config_enabled: %d\n", rc);
+		return rc;
+	}
+
+	if (!rc) {
+		fprintf(stderr, "Fan %d:%d is disabled\n", page, fan);
+		return 0;
+	}
+
+	rc = pmbus_fan_config_get_mode(dev, page, fan);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_fan_config_mode: %d\n", rc);
+		return rc;
+	}
+
+	mode = rc;
+
+	rc = pmbus_fan_command_get(dev, page, fan);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_get_fan_command: %d\n", rc);
+		return rc;
+	}
+
+	coeff = max31785_reg_coeff(PMBUS_FAN_COMMAND_1,
+				   mode == pmbus_fan_mode_rpm);
+	rate = decode_one(coeff, rc);
+
+	rc = pmbus_read_fan_speed(dev, page, fan);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_fan_speed_get: %d\n", rc);
+		return rc;
+	}
+
+	if (rate < 0)
+		printf("Automatic fan control, measured %dRPM\n", rc);
+	else
+		printf("Commanded %g%s, measured %dRPM\n", rate, mode == pmbus_fan_mode_rpm ? "RPM" : "% duty", rc);
+
+	return 0;
+}
+
+static int do_fan_speed_set(struct pmbus_dev *dev, int page, int fan,
+			    enum pmbus_fan_mode mode, int rate)
+{
+	int rc;
+
+	rc = pmbus_fan_config_get_enabled(dev, page, fan);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_fan_config_enabled: %d\n", rc);
+		return rc;
+	}
+
+	if (!rc) {
+		fprintf(stderr, "Fan %d:%d is disabled\n", page, fan);
+		return 0;
+	}
+
+	rc = pmbus_fan_config_set_mode(dev, page, fan, mode);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_fan_config_set_mode: %d\n", rc);
+		return rc;
+	}
+
+	rc = pmbus_fan_command_set(dev, page, fan, rate);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_fan_command_set: %d\n", rc);
+		return rc;
+	}
+
+	return 0;
+}
+
+/* Parse "N%" as a PWM duty or "NRPM" as a speed into a FAN_COMMAND value */
+static int fan_parse_rate(const char *arg, enum pmbus_fan_mode *mode,
+			  int *rate)
+{
+	char *mode_str;
+
+	*rate = strtoul(arg, &mode_str, 0);
+
+	if (!strcasecmp("rpm", mode_str)) {
+		*mode = pmbus_fan_mode_rpm;
+	} else if (!strcasecmp("%", mode_str)) {
+		*mode = pmbus_fan_mode_pwm;
+		*rate *= 100;
+	} else {
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static volatile sig_atomic_t sample_stop;
+
+static void sample_signal(int sig)
+{
+	(void)sig;
+	sample_stop = 1;
+}
+
+/*
+ * Stop sampling loops on SIGINT or SIGTERM. Transfers in flight are restarted
+ * so the adapter isn't left mid-transaction; the pacing sleep never is.
+ */
+static void sample_trap_signals(void)
+{
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = sample_signal;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+}
+
+/* Sleep until @interval_ms after @next, and advance @next to that point */
+static void sample_sleep(struct timespec *next, unsigned interval_ms)
+{
+	next->tv_nsec += (interval_ms % 1000) * 1000000L;
+	next->tv_sec += interval_ms / 1000 + next->tv_nsec / 1000000000L;
+	next->tv_nsec %= 1000000000L;
+	clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, next, NULL);
+}
+
+static void profile_print(const struct pmbus_dev *dev, int page,
+			  const char *dir, const struct profile_result *res,
+			  size_t nsamples)
+{
+	printf("0x%02x:%d: %s %uRPM -> %uRPM: ", dev->addr, page, dir,
+	       res->initial, res->final);
+
+	if (res->reached)
+		printf("t90=%.1fms ", res->t90_ns / 1e6);
+	else
+		printf("t90=- ");
+
+	printf("overshoot=%.1f%% ", res->overshoot);
+
+	if (res->settled)
+		printf("settle=%.1fms ", res->settle_ns / 1e6);
+	else
+		printf("settle=- ");
+
+	printf("(%zu samples, %.2fms period)\n", nsamples,
+	       res->period_ns / 1e6);
+}
+
+/*
+ * Step each enabled fan from @from to @to and back, holding each command for
+ * @duration_ms, and report the response to both steps. The fan's mode and
+ * command are restored afterwards, including when interrupted by SIGINT or
+ * SIGTERM.
+ */
+static int do_profile(struct pmbus_dev *dev, enum pmbus_fan_mode mode,
+		      uint16_t from, uint16_t to, unsigned duration_ms,
+		      unsigned band_pct, struct profile_capture *cap)
+{
+	struct profile_result res;
+	int page;
+	int rc;
+
+	sample_trap_signals();
+	cap->stop = &sample_stop;
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		int old_mode, old_command;
+
+		rc = pmbus_fan_config_get_enabled(dev, page, pmbus_fan_1);
+		if (rc < 0) {
+			fprintf(stderr, "pmbus_fan_config_enabled: %d\n", rc);
+			return rc;
+		}
+
+		if (!rc)
+			continue;
+
+		old_mode = pmbus_fan_config_get_mode(dev, page, pmbus_fan_1);
+		if (old_mode < 0)
+			return old_mode;
+
+		old_command = pmbus_fan_command_get(dev, page, pmbus_fan_1);
+		if (old_command < 0)
+			return old_command;
+
+		rc = pmbus_fan_config_set_mode(dev, page, pmbus_fan_1, mode);
+		if (rc < 0)
+			goto restore;
+
+		/* Settle at the starting command before measuring anything */
+		rc = profile_step(dev, page, pmbus_fan_1, from, duration_ms, cap);
+		if (rc < 0)
+			goto restore;
+
+		rc = profile_step(dev, page, pmbus_fan_1, to, duration_ms, cap);
+		if (rc < 0)
+			goto restore;
+
+		rc = profile_analyse(cap, band_pct, &res);
+		if (rc < 0)
+			goto restore;
+
+		profile_print(dev, page, "up", &res, cap->nsamples);
+
+		rc = profile_step(dev, page, pmbus_fan_1, from, duration_ms, cap);
+		if (rc < 0)
+			goto restore;
+
+		rc = profile_analyse(cap, band_pct, &res);
+		if (rc < 0)
+			goto restore;
+
+		profile_print(dev, page, "down", &res, cap->nsamples);
+
+restore:
+		if (rc == -EINTR)
+			fprintf(stderr, "0x%02x:%d: Interrupted, restoring fan\n",
+				dev->addr, page);
+		else if (rc < 0)
+			fprintf(stderr, "0x%02x:%d: profile: %d\n", dev->addr, page, rc);
+
+		if (pmbus_fan_config_set_mode(dev, page, pmbus_fan_1, old_mode) < 0 ||
+		    pmbus_fan_command_set(dev, page, pmbus_fan_1, old_command) < 0)
+			fprintf(stderr, "0x%02x:%d: Failed to restore fan command\n",
+				dev->addr, page);
+
+		if (rc < 0)
+			return rc;
+
+		fflush(stdout);
+	}
+
+	return 0;
+}
+
+static int do_fan_sweep(struct pmbus_dev *dev)
+{
+	int page;
+	int rc;
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		rc = pmbus_fan_config_get_enabled(dev, page, pmbus_fan_1);
+		if (rc < 0) {
+			fprintf(stderr, "pmbus_fan_config_enabled: %d\n", rc);
+			return rc;
+		}
+
+		if (!rc)
+			continue;
+
+		rc = pmbus_read_fan_speed(dev, page, pmbus_fan_1);
+		if (rc < 0) {
+			fprintf(stderr, "pmbus_fan_speed_get: %d\n", rc);
+			return rc;
+		}
+
+		printf("0x%02x:%d: %dRPM\n", dev->addr, page, rc);
+	}
+
+	return 0;
+}
+
+/* Global registers affect every page, so writes aren't moved across them */
+static bool apply_is_barrier(const struct pmbus_reg *r)
+{
+	const struct max31785_reg *mr = max31785_reg_lookup(r->page, r->reg);
+
+	return mr && (mr->flags & MAX31785_REG_GLOBAL);
+}
+
+/*
+ * Each non-empty line of an apply file is "PAGE REGISTER VALUE [WIDTH]", where
+ * WIDTH is 'b' (the default) or 'w'. Text following a '#' is ignored. Each
+ * register may only appear once. Entries are grouped by page, keeping their
+ * file order within a page and around writes to global registers.
+ */
+static ssize_t apply_parse(FILE *f, struct pmbus_reg **regs)
+{
+	uint8_t seen[PMBUS_PAGES][32];
+	long page, reg, val;
+	char line[256];
+	size_t alloc;
+	unsigned lnr;
+	size_t n;
+
+	memset(seen, 0, sizeof(seen));
+
+	alloc = 0;
+	lnr = 0;
+	n = 0;
+	while (fgets(line, sizeof(line), f)) {
+		char width_str[2] = "b";
+		char *comment;
+		int width;
+		int rc;
+
+		lnr++;
+
+		comment = strchr(line, '#');
+		if (comment)
+			*comment = '\0';
+
+		rc = sscanf(line, "%li %li %li %1s", &page, &reg, &val,
+			    width_str);
+		if (rc == EOF)
+			continue;
+
+		if (rc < 3) {
+			fprintf(stderr, "Malformed entry on line %u\n", lnr);
+			return -EINVAL;
+		}
+
+		width = smbus_parse_width(width_str);
+		if (width < 1 || page < 0 || page >= PMBUS_PAGES || reg < 1 ||
+		    reg > 0xff || val < 0 || val >= (1L << (8 * width))) {
+			fprintf(stderr, "Invalid entry on line %u\n", lnr);
+			return -EINVAL;
+		}
+
+		if (seen[page][reg / 8] & BIT(reg % 8)) {
+			fprintf(stderr, "Duplicate entry on line %u\n", lnr);
+			return -EINVAL;
+		}
+
+		seen[page][reg / 8] |= BIT(reg % 8);
+
+		if (n == alloc) {
+			struct pmbus_reg *new_regs;
+
+			alloc = alloc ? 2 * alloc : 32;
+			new_regs = realloc(*regs, alloc * sizeof(**regs));
+			if (!new_regs)
+				return -ENOMEM;
+			*regs = new_regs;
+		}
+
+		(*regs)[n].page = page;
+		(*regs)[n].reg = reg;
+		(*regs)[n].width = width;
+		(*regs)[n].val = val;
+		n++;
+	}
+
+	if (ferror(f))
+		return -errno;
+
+	pmbus_regs_sort(*regs, n, apply_is_barrier);
+
+	return n;
+}
+
+static int do_apply(struct pmbus_dev *dev, const struct pmbus_reg *want,
+		    size_t n, struct pmbus_reg *scratch)
+{
+	size_t i, ndiff;
+	int rc;
+
+	memcpy(scratch, want, n * sizeof(*scratch));
+	rc = pmbus_read_regs(dev, scratch, n);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_read_regs: %d\n", rc);
+		return rc;
+	}
+
+	/* Reduce scratch to the entries that differ, preserving page order */
+	for (i = 0, ndiff = 0; i < n; i++) {
+		if (scratch[i].val != want[i].val)
+			scratch[ndiff++] = want[i];
+	}
+
+	rc = pmbus_write_regs(dev, scratch, ndiff);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_write_regs: %d\n", rc);
+		return rc;
+	}
+
+	/* Verify against the device rather than our write-through cache */
+	pmbus_dev_invalidate(dev);
+
+	memcpy(scratch, want, n * sizeof(*scratch));
+	rc = pmbus_read_regs(dev, scratch, n);
+	if (rc < 0) {
+		fprintf(stderr, "pmbus_read_regs: %d\n", rc);
+		return rc;
+	}
+
+	for (i = 0, rc = 0; i < n; i++) {
+		if (scratch[i].val == want[i].val)
+			continue;
+
+		fprintf(stderr, "0x%02x:%u: 0x%02x: Wrote 0x%04x, read 0x%04x\n",
+			dev->addr, want[i].page, want[i].reg, want[i].val,
+			scratch[i].val);
+		rc = -EIO;
+	}
+
+	if (!rc)
+		printf("0x%02x: %zu registers, %zu written, verified\n",
+		       dev->addr, n, ndiff);
+
+	return rc;
+}
+
+struct dump_skipped {
+	const struct pmbus_dev *dev;
+	size_t count;
+};
+
+static void dump_skip(void *arg, uint8_t page, const struct max31785_reg *r,
+		      int err)
+{
+	struct dump_skipped *skipped = arg;
+
+	fprintf(stderr, "0x%02x:%u: %s: skipped: %s\n", skipped->dev->addr,
+		page, r->name, strerror(-err));
+	skipped->count++;
+}
+
+static int do_dump(struct pmbus_dev *dev, FILE *f)
+{
+	struct dump_skipped skipped = { .dev = dev };
+	uint8_t *buf;
+	size_t len;
+	ssize_t rc;
+
+	len = max31785_image_size();
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	rc = max31785_dump(dev, buf, len, dump_skip, &skipped);
+	if (rc < 0) {
+		fprintf(stderr, "max31785_dump: %zd\n", rc);
+		goto cleanup_buf;
+	}
+
+	if (fwrite(buf, rc, 1, f) != 1) {
+		rc = -EIO;
+		goto cleanup_buf;
+	}
+
+	fprintf(stderr, "0x%02x: %u registers, %zu skipped\n", dev->addr,
+		buf[6] | buf[7] << 8, skipped.count);
+
+	rc = 0;
+
+cleanup_buf:
+	free(buf);
+
+	return rc;
+}
+
+/*
+ * Images are applied to the devices in the order they appear in the file.
+ * Each must have been taken from the device it is applied to unless @force.
+ */
+static int do_restore(struct pmbus_dev *devs, size_t ndevs, FILE *f,
+		      bool force)
+{
+	size_t i, len, off, written;
+	uint8_t *buf;
+	ssize_t rc;
+
+	len = ndevs * max31785_image_size();
+	buf = malloc(len);
+	if (!buf)
+		return -ENOMEM;
+
+	len = fread(buf, 1, len, f);
+	if (ferror(f)) {
+		rc = -EIO;
+		goto cleanup_buf;
+	}
+
+	for (i = 0, off = 0; i < ndevs; i++, off += rc) {
+		rc = max31785_restore(&devs[i], &buf[off], len - off, force,
+				      &written);
+		if (rc == -EADDRNOTAVAIL) {
+			fprintf(stderr, "0x%02x: Image is from device 0x%02x, use --force to restore it\n",
+				devs[i].addr, buf[off + 5]);
+			goto cleanup_buf;
+		}
+
+		if (rc < 0) {
+			fprintf(stderr, "max31785_restore: %zd\n", rc);
+			goto cleanup_buf;
+		}
+
+		fprintf(stderr, "0x%02x: %zu registers written\n", devs[i].addr,
+			written);
+	}
+
+	rc = 0;
+
+cleanup_buf:
+	free(buf);
+
+	return rc;
+}
+
+static void watch_print(const struct pmbus_dev *dev, const struct telemetry *t,
+			unsigned changed, bool keyframe)
+{
+	int page;
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		const struct telemetry_fan *fan = &t->fan[page];
+
+		if (!(changed & BIT(page)))
+			continue;
+
+		printf("%ld.%03ld 0x%02x %d %s enabled=%d mode=%s command=%d speed=%u status_word=0x%04x status_fans=0x%02x\n",
+		       (long)t->ts.tv_sec, t->ts.tv_nsec / 1000000L, dev->addr,
+		       page, keyframe ? "key" : "delta", fan->enabled,
+		       fan->rpm ? "rpm" : "pwm", (int16_t)fan->command,
+		       fan->speed, fan->status_word, fan->status_fans);
+	}
+}
+
+static int do_watch(struct pmbus_dev *devs, size_t ndevs,
+		    unsigned interval_ms, const struct watch_config *cfg)
+{
+	struct watch_state state[MAX31785K_DEVICES_MAX];
+	struct telemetry_sampler sampler;
+	struct timespec next;
+	size_t i;
+	int rc;
+
+	rc = telemetry_sampler_init(&sampler);
+	if (rc < 0)
+		return rc;
+
+	for (i = 0; i < ndevs; i++)
+		watch_init(&state[i]);
+
+	sample_trap_signals();
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	while (!sample_stop) {
+		for (i = 0; i < ndevs; i++) {
+			struct telemetry t;
+			unsigned changed;
+			bool keyframe;
+
+			rc = telemetry_sample(&sampler, &devs[i], &t);
+			if (rc < 0) {
+				fprintf(stderr, "0x%02x: telemetry_sample: %d\n",
+					devs[i].addr, rc);
+				pmbus_dev_invalidate(&devs[i]);
+				continue;
+			}
+
+			changed = watch_update(cfg, &state[i], &t, &keyframe);
+			watch_print(&devs[i], &t, changed, keyframe);
+		}
+
+		fflush(stdout);
+
+		sample_sleep(&next, interval_ms);
+	}
+
+	telemetry_sampler_destroy(&sampler);
+
+	return 0;
+}
+
+/* Compile a plan reading the speed of each of @dev's enabled fan pages */
+static int log_plan_compile(struct pmbus_dev *dev, struct plan *plan,
+			    uint8_t *pages, size_t *npages)
+{
+	struct plan_op ops[MAX31785_FAN_PAGES];
+	size_t n = 0;
+	int page;
+	int rc;
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		rc = pmbus_fan_config_get_enabled(dev, page, pmbus_fan_1);
+		if (rc < 0)
+			return rc;
+
+		if (!rc)
+			continue;
+
+		ops[n] = (struct plan_op){
+			.page = page,
+			.reg = PMBUS_READ_FAN_SPEED_1,
+			.width = 2,
+		};
+		pages[n++] = page;
+	}
+
+	*npages = n;
+
+	return plan_compile(plan, ops, n);
+}
+
+/*
+ * Log the fan speed of every fan page of every device. Only the pages enabled
+ * when logging starts are read, the others log 0. A device that fails to
+ * sample repeats its previous speeds so the series stay aligned.
+ */
+static int do_log(struct pmbus_dev *devs, size_t ndevs, const char *path,
+		  unsigned interval_ms)
+{
+	struct tslog_series series[MAX31785K_DEVICES_MAX * MAX31785_FAN_PAGES];
+	uint16_t vals[MAX31785K_DEVICES_MAX * MAX31785_FAN_PAGES];
+	uint8_t pages[MAX31785K_DEVICES_MAX][MAX31785_FAN_PAGES];
+	size_t npages[MAX31785K_DEVICES_MAX];
+	struct plan plans[MAX31785K_DEVICES_MAX];
+	struct tslog_writer log;
+	struct timespec next;
+	size_t ncompiled;
+	int64_t last_us;
+	size_t i, page;
+	int rc, err;
+
+	for (i = 0; i < ndevs; i++) {
+		for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+			series[i * MAX31785_FAN_PAGES + page].addr = devs[i].addr;
+			series[i * MAX31785_FAN_PAGES + page].page = page;
+		}
+	}
+
+	memset(vals, 0, sizeof(vals));
+
+	for (ncompiled = 0; ncompiled < ndevs; ncompiled++) {
+		rc = log_plan_compile(&devs[ncompiled], &plans[ncompiled],
+				      pages[ncompiled], &npages[ncompiled]);
+		if (rc < 0) {
+			fprintf(stderr, "0x%02x: Failed to find enabled fans: %d\n",
+				devs[ncompiled].addr, rc);
+			goto cleanup_plans;
+		}
+	}
+
+	rc = tslog_writer_open(&log, path, series, ndevs * MAX31785_FAN_PAGES);
+	if (rc < 0)
+		goto cleanup_plans;
+
+	sample_trap_signals();
+
+	clock_gettime(CLOCK_MONOTONIC, &next);
+
+	rc = 0;
+	last_us = INT64_MIN;
+	while (!sample_stop) {
+		uint16_t speeds[MAX31785_FAN_PAGES];
+		bool sampled = false;
+		struct timespec now;
+		int64_t t_us;
+
+		for (i = 0; i < ndevs; i++) {
+			err = plan_run(&plans[i], &devs[i], 1, speeds);
+			if (err < 0) {
+				fprintf(stderr, "0x%02x: plan_run: %d\n",
+					devs[i].addr, err);
+				pmbus_dev_invalidate(&devs[i]);
+				continue;
+			}
+
+			for (page = 0; page < npages[i]; page++)
+				vals[i * MAX31785_FAN_PAGES + pages[i][page]] =
+					speeds[page];
+
+			sampled = true;
+		}
+
+		if (sampled) {
+			clock_gettime(CLOCK_REALTIME, &now);
+			t_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+			/* Don't let a wall clock step break the log's ordering */
+			if (t_us < last_us)
+				t_us = last_us;
+
+			rc = tslog_writer_append(&log, t_us, vals);
+			if (rc < 0)
+				break;
+
+			last_us = t_us;
+		}
+
+		sample_sleep(&next, interval_ms);
+	}
+
+	err = tslog_writer_close(&log);
+	if (!rc)
+		rc = err;
+
+cleanup_plans:
+	while (ncompiled--)
+		plan_destroy(&plans[ncompiled]);
+
+	return rc;
+}
+
 static void help(const char *name)
 {
-	fprintf(stderr, "USAGE: %s HIDRAW SUBCOMMAND\n", name);
+	fprintf(stderr, "USAGE: %s [-p] [-s STATE] [-a ADDRESS]... DEVICE SUBCOMMAND\n", name);
 }
 
 static const uint8_t max31785_address = 0x52;
 
-int main(int argc, const char *argv[])
+/* Reads failing the PEC check are repeated this many times */
+#define MAX31785K_PEC_RETRIES	2
+
+int main(int argc, char *argv[])
 {
+	struct pmbus_dev devs[MAX31785K_DEVICES_MAX];
+	uint8_t addrs[MAX31785K_DEVICES_MAX];
+	const char *state_path;
 	const char *subcmd;
 	const char *path;
+	union {
+		struct ds3900_bus ds3900;
+		struct i2cdev_bus i2cdev;
+	} transport;
+	const char *name;
+	struct smbus *bus;
+	bool is_i2cdev;
+	bool raw;
+	bool pec;
+	size_t ndevs;
+	size_t i;
+	int opt;
 	int fd;
 	int rc;
 
-	if (argc < 3) {
+	ndevs = 0;
+	raw = false;
+	pec = false;
+	state_path = NULL;
+	while ((opt = getopt(argc, argv, "+a:ps:")) != -1) {
+		unsigned long addr;
+		char *end;
+
+		switch (opt) {
+			case 'a':
+				addr = strtoul(optarg, &end, 0);
+				if (*end || addr > 0x7f) {
+					fprintf(stderr, "Invalid device address: %s\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				if (ndevs == MAX31785K_DEVICES_MAX) {
+					fprintf(stderr, "Too many devices\n");
+					exit(EXIT_FAILURE);
+				}
+
+				addrs[ndevs++] = addr;
+				break;
+			case 'p':
+				pec = true;
+				break;
+			case 's':
+				state_path = optarg;
+				break;
+			default:
+				help(argv[0]);
+				exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!ndevs)
+		addrs[ndevs++] = max31785_address;
+
+	if (argc - optind < 2) {
 		help(argv[0]);
 		exit(EXIT_FAILURE);
 	}
 
+	/* Shift so the subcommand parsing below sees DEVICE as argv[1] */
+	argc -= optind - 1;
+	argv[optind - 1] = argv[0];
+	argv += optind - 1;
+
 	path = argv[1];
 	subcmd = argv[2];
 
@@ -169,13 +931,47 @@ int main(int argc, const char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
+	/* DEVICE is either a DS3900 hidraw node or a /dev/i2c-N adapter */
+	name = strrchr(path, '/');
+	name = name ? name + 1 : path;
+	is_i2cdev = !strncmp("i2c-", name, 4);
+
+	if (is_i2cdev) {
+		i2cdev_bus_init(&transport.i2cdev, fd);
+		bus = &transport.i2cdev.bus;
+	} else {
+		ds3900_bus_init(&transport.ds3900, fd);
+		bus = &transport.ds3900.bus;
+	}
+
+	smbus_set_pec(bus, pec, MAX31785K_PEC_RETRIES);
+
+	for (i = 0; i < ndevs; i++)
+		pmbus_dev_init(&devs[i], bus, addrs[i]);
+
+	/* A missing or stale state file just means a cold start */
+	if (state_path) {
+		rc = state_load(state_path, devs, ndevs);
+		if (rc < 0 && rc != -ENOENT)
+			fprintf(stderr, "Failed to load %s: %s\n", state_path,
+				strerror(-rc));
+	}
+
 	if (!strcmp("revision", subcmd)) {
+		if (is_i2cdev) {
+			fprintf(stderr, "revision requires a DS3900 adapter\n");
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
 		rc = do_ds3900_revision(fd);
 	} else if (!strcmp("get", subcmd)) {
 		const char *reg_str, *width_str;
 		unsigned long reg;
 		int width;
 
+		raw = true;
+
 		if (argc < 4) {
 			help(argv[0]);
 			rc = EXIT_FAILURE;
@@ -197,12 +993,19 @@ int main(int argc, const char *argv[])
 			width = 1;
 		}
 
-		rc = do_ds3900_get(fd, max31785_address, reg, width);
+		for (i = 0, rc = 0; !rc && i < ndevs; i++) {
+			if (ndevs > 1)
+				printf("Device 0x%02x:\n", addrs[i]);
+
+			rc = do_ds3900_get(bus, addrs[i], reg, width);
+		}
 	} else if (!strcmp("set", subcmd)) {
 		const char *reg_str, *val_str, *width_str;
 		unsigned long reg, val;
 		int width;
 
+		raw = true;
+
 		if (argc < 5) {
 			help(argv[0]);
 			rc = EXIT_FAILURE;
@@ -216,7 +1019,7 @@ int main(int argc, const char *argv[])
 		val = strtoul(val_str, NULL, 0);
 
 		if (argc > 5) {
-			width_str = argv[6];
+			width_str = argv[5];
 			width = smbus_parse_width(width_str);
 			if (width < 0) {
 				help(argv[0]);
@@ -227,37 +1030,33 @@ int main(int argc, const char *argv[])
 			width = 1;
 		}
 
-		rc = do_ds3900_set(fd, max31785_address, reg, val, width);
+		for (i = 0, rc = 0; !rc && i < ndevs; i++)
+			rc = do_ds3900_set(bus, addrs[i], reg, val, width);
 	} else if (!strcmp("thrash-pages", subcmd)) {
 		bool match;
 		unsigned i;
 		int page;
 
+		raw = true;
+
 		if (argc < 3) {
 			help(argv[0]);
 			rc = EXIT_FAILURE;
 			goto cleanup_fd;
 		}
 
-		rc = ds3900_packet_device_address(fd, max31785_address);
-		if (rc < 0) {
-			fprintf(stderr, "Failed to set device address: %s", strerror(-rc));
-			rc = EXIT_FAILURE;
-			goto cleanup_fd;
-		}
-
 		page = 0;
 		match = true;
 		for (i = 0; match; i++) {
 			if (!(i % 100))
 				printf("%u\n", i);
 
-			rc = smbus_write_byte(fd, 0, page);
+			rc = smbus_write_byte(bus, addrs[0], 0, page);
 			if (rc < 0) {
 				fprintf(stderr, "Failed to set page: %s", strerror(-rc));
 				break;
 			}
-			rc = smbus_read_byte(fd, 0);
+			rc = smbus_read_byte(bus, addrs[0], 0);
 			if (rc < 0) {
 				fprintf(stderr, "Failed to get page: %s", strerror(-rc));
 				break;
@@ -269,6 +1068,156 @@ int main(int argc, const char *argv[])
 					i, page, rc);
 			page = (page + 1) % 22;
 		}
+	} else if (!strcmp("apply", subcmd)) {
+		struct pmbus_reg *want, *scratch;
+		ssize_t n;
+		FILE *f;
+
+		if (argc < 4) {
+			help(argv[0]);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		f = strcmp("-", argv[3]) ? fopen(argv[3], "r") : stdin;
+		if (!f) {
+			perror("fopen");
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		want = NULL;
+		n = apply_parse(f, &want);
+		if (f != stdin)
+			fclose(f);
+
+		if (n < 0) {
+			free(want);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		scratch = malloc(n * sizeof(*scratch) ?: 1);
+		if (!scratch) {
+			free(want);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		for (i = 0, rc = 0; !rc && i < ndevs; i++)
+			rc = do_apply(&devs[i], want, n, scratch);
+
+		free(scratch);
+		free(want);
+	} else if (!strcmp("dump", subcmd) || !strcmp("restore", subcmd)) {
+		bool is_dump = !strcmp("dump", subcmd);
+		bool force = false;
+		FILE *f;
+
+		if (argc < 4) {
+			help(argv[0]);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		if (argc > 4) {
+			if (is_dump || strcmp("--force", argv[4])) {
+				help(argv[0]);
+				rc = EXIT_FAILURE;
+				goto cleanup_fd;
+			}
+
+			force = true;
+		}
+
+		if (!strcmp("-", argv[3]))
+			f = is_dump ? stdout : stdin;
+		else
+			f = fopen(argv[3], is_dump ? "wb" : "rb");
+
+		if (!f) {
+			perror("fopen");
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		if (is_dump) {
+			for (i = 0, rc = 0; !rc && i < ndevs; i++)
+				rc = do_dump(&devs[i], f);
+		} else {
+			rc = do_restore(devs, ndevs, f, force);
+		}
+
+		if (f != stdout && f != stdin && fclose(f) && !rc)
+			rc = -errno;
+	} else if (!strcmp("watch", subcmd)) {
+		struct watch_config cfg;
+		unsigned long interval_ms;
+
+		interval_ms = argc > 3 ? strtoul(argv[3], NULL, 0) : 100;
+		cfg.rpm_deadband = argc > 4 ? strtoul(argv[4], NULL, 0) : 50;
+		cfg.keyframe_interval = argc > 5 ? strtoul(argv[5], NULL, 0) : 600;
+
+		rc = do_watch(devs, ndevs, interval_ms, &cfg);
+	} else if (!strcmp("log", subcmd)) {
+		unsigned long interval_ms;
+
+		if (argc < 4) {
+			help(argv[0]);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		interval_ms = argc > 4 ? strtoul(argv[4], NULL, 0) : 100;
+
+		rc = do_log(devs, ndevs, argv[3], interval_ms);
+		if (rc < 0)
+			fprintf(stderr, "Failed to log telemetry: %s\n", strerror(-rc));
+	} else if (!strcmp("serve", subcmd)) {
+		unsigned long interval_ms;
+
+		if (argc < 4) {
+			help(argv[0]);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		interval_ms = argc > 4 ? strtoul(argv[4], NULL, 0) : 1000;
+
+		rc = metrics_serve(devs, ndevs, argv[3], interval_ms);
+		if (rc < 0)
+			fprintf(stderr, "Failed to serve metrics: %s\n", strerror(-rc));
+	} else if (!strcmp("profile", subcmd)) {
+		enum pmbus_fan_mode from_mode, to_mode;
+		struct profile_capture cap;
+		unsigned long duration_ms;
+		unsigned long band_pct;
+		int from, to;
+
+		if (argc < 5 || fan_parse_rate(argv[3], &from_mode, &from) ||
+		    fan_parse_rate(argv[4], &to_mode, &to) ||
+		    from_mode != to_mode) {
+			help(argv[0]);
+			rc = EXIT_FAILURE;
+			goto cleanup_fd;
+		}
+
+		duration_ms = argc > 5 ? strtoul(argv[5], NULL, 0) : 5000;
+		band_pct = argc > 6 ? strtoul(argv[6], NULL, 0) : 2;
+
+		/* Thinned when full, so any read rate covers the duration */
+		rc = profile_capture_init(&cap, MAX31785K_PROFILE_SAMPLES);
+		if (rc < 0)
+			goto cleanup_fd;
+
+		for (i = 0, rc = 0; !rc && i < ndevs; i++)
+			rc = do_profile(&devs[i], to_mode, from, to, duration_ms,
+					band_pct, &cap);
+
+		profile_capture_destroy(&cap);
+	} else if (!strcmp("sweep", subcmd)) {
+		for (i = 0, rc = 0; !rc && i < ndevs; i++)
+			rc = do_fan_sweep(&devs[i]);
 	} else if (!strcmp("fan", subcmd)) {
 		if (argc < 5) {
 			help(argv[0]);
@@ -284,9 +1233,7 @@ int main(int argc, const char *argv[])
 
 		if (!strcmp("get", argv[4])) {
 			const char *page_str, *fan_str;
-			enum pmbus_fan_mode mode;
 			int page, fan;
-			int16_t rate;
 
 			if (argc < 7) {
 				help(argv[0]);
@@ -300,56 +1247,14 @@ int main(int argc, const char *argv[])
 			fan_str = argv[6];
 			fan = strtoul(fan_str, NULL, 0);
 
-			rc = ds3900_packet_device_address(fd, max31785_address);
-			if (rc < 0) {
-				fprintf(stderr, "Failed to set device address: %s", strerror(-rc));
-				rc = EXIT_FAILURE;
-				goto cleanup_fd;
-			}
-
-			rc = pmbus_fan_config_get_enabled(fd, page, fan);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_fan_config_enabled: %d\n", rc);
-				goto cleanup_fd;
-			}
-
-			if (!rc) {
-				fprintf(stderr, "Fan %d:%d is disabled\n", page, fan);
-				goto cleanup_fd;
-			}
+			for (i = 0, rc = 0; !rc && i < ndevs; i++) {
+				if (ndevs > 1)
+					printf("Device 0x%02x:\n", addrs[i]);
 
-			rc = pmbus_fan_config_get_mode(fd, page, fan);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_fan_config_mode: %d\n", rc);
-				goto cleanup_fd;
+				rc = do_fan_speed_get(&devs[i], page, fan);
 			}
-
-			mode = rc;
-
-			rc = pmbus_fan_command_get(fd, page, fan);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_get_fan_command: %d\n", rc);
-				goto cleanup_fd;
-			}
-
-			rate = (int16_t)rc;
-			if (mode == pmbus_fan_mode_pwm)
-				rate /= 100;
-
-			rc = pmbus_read_fan_speed(fd, page, fan);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_fan_speed_get: %d\n", rc);
-				goto cleanup_fd;
-			}
-
-			if (rate < 0)
-				printf("Automatic fan control, measured %dRPM\n", rc);
-			else
-				printf("Commanded %"PRId16"%s, measured %dRPM\n", rate, mode == pmbus_fan_mode_rpm ? "RPM" : "% duty", rc);
-			rc = 0;
 		} else if (!strcmp("set", argv[4])) {
-			const char *page_str, *fan_str, *rate_str;
-			char *mode_str;
+			const char *page_str, *fan_str;
 			enum pmbus_fan_mode mode;
 			int page, fan, rate;
 
@@ -365,55 +1270,14 @@ int main(int argc, const char *argv[])
 			fan_str = argv[6];
 			fan = strtoul(fan_str, NULL, 0);
 
-			rate_str = argv[7];
-			rate = strtoul(rate_str, &mode_str, 0);
-
-			if (!strlen(mode_str)) {
+			if (fan_parse_rate(argv[7], &mode, &rate)) {
 				help(argv[0]);
 				rc = EXIT_FAILURE;
 				goto cleanup_fd;
 			}
 
-			if (!strcasecmp("rpm", mode_str)) {
-				mode = pmbus_fan_mode_rpm;
-			} else if (!strcasecmp("%", mode_str)) {
-				mode = pmbus_fan_mode_pwm;
-				rate *= 100;
-			} else {
-				help(argv[0]);
-				rc = EXIT_FAILURE;
-				goto cleanup_fd;
-			}
-
-			rc = ds3900_packet_device_address(fd, max31785_address);
-			if (rc < 0) {
-				fprintf(stderr, "Failed to set device address: %s", strerror(-rc));
-				goto cleanup_fd;
-			}
-
-			rc = pmbus_fan_config_get_enabled(fd, page, fan);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_fan_config_enabled: %d\n", rc);
-				goto cleanup_fd;
-			}
-
-			if (!rc) {
-				fprintf(stderr, "Fan %d:%d is disabled\n", page, fan);
-				goto cleanup_fd;
-			}
-
-			rc = pmbus_fan_config_set_mode(fd, page, fan, mode);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_fan_config_set_mode: %d\n", rc);
-				goto cleanup_fd;
-			}
-
-			rc = pmbus_fan_command_set(fd, page, fan, rate);
-			if (rc < 0) {
-				fprintf(stderr, "pmbus_fan_config_set_mode: %d\n", rc);
-				goto cleanup_fd;
-			}
-
+			for (i = 0, rc = 0; !rc && i < ndevs; i++)
+				rc = do_fan_speed_set(&devs[i], page, fan, mode, rate);
 		} else {
 			help(argv[0]);
 			rc = EXIT_FAILURE;
@@ -428,6 +1292,26 @@ int main(int argc, const char *argv[])
 cleanup_fd:
 	rc = rc ? EXIT_FAILURE : EXIT_SUCCESS;
 
+	/*
+	 * Raw accesses bypass the register cache and the tracked page, so the
+	 * state is dropped after them. A failed subcommand leaves the device in
+	 * an unknown state, so the previous file is kept for revalidation.
+	 */
+	if (state_path && raw) {
+		if (unlink(state_path) < 0 && errno != ENOENT)
+			fprintf(stderr, "Failed to remove %s: %s\n", state_path,
+				strerror(errno));
+	} else if (state_path && rc == EXIT_SUCCESS) {
+		int err = state_save(state_path, devs, ndevs);
+
+		if (err < 0)
+			fprintf(stderr, "Failed to save %s: %s\n", state_path,
+				strerror(-err));
+	}
+
+	if (bus->pec_errors)
+		fprintf(stderr, "%lu PEC errors\n", bus->pec_errors);
+
 	close(fd);
 
 	exit(rc);
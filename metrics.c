@@ -0,0 +1,422 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "metrics.h"
+#include "pmbus.h"
+#include "telemetry.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A client that stalls mid-request or mid-response holds up every scrape */
+#define METRICS_CONN_TIMEOUT_MS	1000
+
+/*
+ * The sampler thread is the only user of the bus. Scrapes are rendered from a
+ * copy of the latest snapshots taken under the lock and never touch the bus.
+ */
+struct metrics {
+	pthread_mutex_t lock;
+	struct pmbus_dev *devs;
+	size_t ndevs;
+	unsigned interval_ms;
+	struct telemetry_sampler sampler;
+
+	/* Protected by lock */
+	struct telemetry *snap;
+	bool *valid;
+	uint64_t sweeps;
+	uint64_t errors;
+};
+
+static volatile sig_atomic_t metrics_stop;
+
+static void metrics_signal(int sig)
+{
+	(void)sig;
+	metrics_stop = 1;
+}
+
+static void *metrics_sampler(void *arg)
+{
+	struct metrics *ctx = arg;
+	struct timespec interval;
+	struct telemetry t;
+	size_t i;
+	int rc;
+
+	interval.tv_sec = ctx->interval_ms / 1000;
+	interval.tv_nsec = (ctx->interval_ms % 1000) * 1000000L;
+
+	while (!metrics_stop) {
+		for (i = 0; i < ctx->ndevs; i++) {
+			rc = telemetry_sample(&ctx->sampler, &ctx->devs[i], &t);
+			if (rc < 0) {
+				/* The bus state is unknown after a failed transfer */
+				pmbus_dev_invalidate(&ctx->devs[i]);
+			}
+
+			pthread_mutex_lock(&ctx->lock);
+			if (rc < 0) {
+				ctx->errors++;
+			} else {
+				ctx->snap[i] = t;
+				ctx->valid[i] = true;
+			}
+			pthread_mutex_unlock(&ctx->lock);
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		ctx->sweeps++;
+		pthread_mutex_unlock(&ctx->lock);
+
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+struct metrics_desc {
+	const char *name;
+	const char *help;
+	long (*value)(const struct telemetry_fan *fan);
+};
+
+static long metrics_fan_enabled(const struct telemetry_fan *fan)
+{
+	return fan->enabled;
+}
+
+static long metrics_fan_rpm_mode(const struct telemetry_fan *fan)
+{
+	return fan->rpm;
+}
+
+static long metrics_fan_command(const struct telemetry_fan *fan)
+{
+	return (int16_t)fan->command;
+}
+
+static long metrics_fan_speed(const struct telemetry_fan *fan)
+{
+	return fan->speed;
+}
+
+static long metrics_status_word(const struct telemetry_fan *fan)
+{
+	return fan->status_word;
+}
+
+static long metrics_status_fans(const struct telemetry_fan *fan)
+{
+	return fan->status_fans;
+}
+
+static const struct metrics_desc metrics_fan_descs[] = {
+	{ "max31785_fan_enabled", "Fan is enabled in FAN_CONFIG",
+	  metrics_fan_enabled },
+	{ "max31785_fan_rpm_mode", "Fan is commanded in RPM rather than PWM",
+	  metrics_fan_rpm_mode },
+	{ "max31785_fan_command", "Raw FAN_COMMAND value, negative for automatic control",
+	  metrics_fan_command },
+	{ "max31785_fan_speed_rpm", "Measured fan speed",
+	  metrics_fan_speed },
+	{ "max31785_status_word", "STATUS_WORD of the fan page",
+	  metrics_status_word },
+	{ "max31785_status_fans", "STATUS_FANS_12 of the fan page",
+	  metrics_status_fans },
+};
+
+static void metrics_render(FILE *out, const struct pmbus_dev *devs,
+			   size_t ndevs, const struct telemetry *snap,
+			   const bool *valid, uint64_t sweeps, uint64_t errors)
+{
+	size_t i, j;
+	int page;
+
+	fprintf(out, "# HELP max31785_sweeps_total Completed sampler sweeps\n");
+	fprintf(out, "# TYPE max31785_sweeps_total counter\n");
+	fprintf(out, "max31785_sweeps_total %" PRIu64 "\n", sweeps);
+	fprintf(out, "# HELP max31785_sample_errors_total Failed device samples\n");
+	fprintf(out, "# TYPE max31785_sample_errors_total counter\n");
+	fprintf(out, "max31785_sample_errors_total %" PRIu64 "\n", errors);
+
+	fprintf(out, "# HELP max31785_sample_timestamp_seconds Time of the latest sample\n");
+	fprintf(out, "# TYPE max31785_sample_timestamp_seconds gauge\n");
+	for (i = 0; i < ndevs; i++) {
+		if (!valid[i])
+			continue;
+
+		fprintf(out, "max31785_sample_timestamp_seconds{device=\"0x%02x\"} %ld.%03ld\n",
+			devs[i].addr, (long)snap[i].ts.tv_sec,
+			snap[i].ts.tv_nsec / 1000000L);
+	}
+
+	for (j = 0; j < ARRAY_SIZE(metrics_fan_descs); j++) {
+		const struct metrics_desc *desc = &metrics_fan_descs[j];
+
+		fprintf(out, "# HELP %s %s\n", desc->name, desc->help);
+		fprintf(out, "# TYPE %s gauge\n", desc->name);
+
+		for (i = 0; i < ndevs; i++) {
+			if (!valid[i])
+				continue;
+
+			for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+				const struct telemetry_fan *fan = &snap[i].fan[page];
+
+				if (!fan->enabled && desc->value != metrics_fan_enabled)
+					continue;
+
+				fprintf(out, "%s{device=\"0x%02x\",page=\"%d\"} %ld\n",
+					desc->name, devs[i].addr, page,
+					desc->value(fan));
+			}
+		}
+	}
+}
+
+static int metrics_respond(struct metrics *ctx, int conn,
+			   struct telemetry *snap, bool *valid)
+{
+	uint64_t sweeps, errors;
+	struct timeval timeout;
+	char req[1024];
+	size_t body_len;
+	char *body;
+	char hdr[128];
+	FILE *out;
+	int len;
+
+	timeout.tv_sec = METRICS_CONN_TIMEOUT_MS / 1000;
+	timeout.tv_usec = (METRICS_CONN_TIMEOUT_MS % 1000) * 1000;
+	if (setsockopt(conn, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0 ||
+	    setsockopt(conn, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout)) < 0)
+		return -errno;
+
+	/* We serve the same document for any request */
+	if (recv(conn, req, sizeof(req), 0) < 0)
+		return -errno;
+
+	pthread_mutex_lock(&ctx->lock);
+	memcpy(snap, ctx->snap, ctx->ndevs * sizeof(*snap));
+	memcpy(valid, ctx->valid, ctx->ndevs * sizeof(*valid));
+	sweeps = ctx->sweeps;
+	errors = ctx->errors;
+	pthread_mutex_unlock(&ctx->lock);
+
+	out = open_memstream(&body, &body_len);
+	if (!out)
+		return -errno;
+
+	metrics_render(out, ctx->devs, ctx->ndevs, snap, valid, sweeps, errors);
+
+	if (fclose(out)) {
+		free(body);
+		return -ENOMEM;
+	}
+
+	len = snprintf(hdr, sizeof(hdr),
+		       "HTTP/1.0 200 OK\r\n"
+		       "Content-Type: text/plain; version=0.0.4\r\n"
+		       "Content-Length: %zu\r\n\r\n", body_len);
+
+	if (send(conn, hdr, len, MSG_NOSIGNAL) < 0 ||
+	    send(conn, body, body_len, MSG_NOSIGNAL) < 0) {
+		free(body);
+		return -errno;
+	}
+
+	free(body);
+
+	return 0;
+}
+
+/* @listen is either "unix:PATH" or "tcp:PORT", the latter bound to loopback */
+static int metrics_listen(const char *listen_str)
+{
+	int fd;
+	int rc;
+
+	if (!strncmp("unix:", listen_str, 5)) {
+		struct sockaddr_un addr = { .sun_family = AF_UNIX };
+		const char *path = listen_str + 5;
+		struct stat st;
+
+		if (strlen(path) >= sizeof(addr.sun_path))
+			return -ENAMETOOLONG;
+
+		strcpy(addr.sun_path, path);
+
+		/* Replace a stale socket, but never anything else at @path */
+		if (!lstat(path, &st)) {
+			if (!S_ISSOCK(st.st_mode))
+				return -EEXIST;
+			if (unlink(path) < 0)
+				return -errno;
+		} else if (errno != ENOENT) {
+			return -errno;
+		}
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			goto cleanup_fd;
+	} else if (!strncmp("tcp:", listen_str, 4)) {
+		struct sockaddr_in addr = { .sin_family = AF_INET };
+		unsigned long port;
+		char *end;
+		int one;
+
+		port = strtoul(listen_str + 4, &end, 10);
+		if (*end || !port || port > UINT16_MAX)
+			return -EINVAL;
+
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+
+		one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+			goto cleanup_fd;
+	} else {
+		return -EINVAL;
+	}
+
+	if (listen(fd, 8) < 0)
+		goto cleanup_fd;
+
+	return fd;
+
+cleanup_fd:
+	rc = -errno;
+	close(fd);
+
+	return rc;
+}
+
+int metrics_serve(struct pmbus_dev *devs, size_t ndevs, const char *listen_str,
+		  unsigned interval_ms)
+{
+	struct telemetry *scrape_snap;
+	sigset_t sigs, old_sigs;
+	struct sigaction sa;
+	struct metrics ctx;
+	pthread_t sampler;
+	bool *scrape_valid;
+	int sfd;
+	int rc;
+
+	/* Each sweep would start straight after the last, hogging the bus */
+	if (!interval_ms)
+		return -EINVAL;
+
+	memset(&ctx, 0, sizeof(ctx));
+	ctx.devs = devs;
+	ctx.ndevs = ndevs;
+	ctx.interval_ms = interval_ms;
+
+	ctx.snap = calloc(ndevs, sizeof(*ctx.snap));
+	ctx.valid = calloc(ndevs, sizeof(*ctx.valid));
+	scrape_snap = calloc(ndevs, sizeof(*scrape_snap));
+	scrape_valid = calloc(ndevs, sizeof(*scrape_valid));
+	if (!ctx.snap || !ctx.valid || !scrape_snap || !scrape_valid) {
+		rc = -ENOMEM;
+		goto cleanup_mem;
+	}
+
+	rc = telemetry_sampler_init(&ctx.sampler);
+	if (rc < 0)
+		goto cleanup_mem;
+
+	sfd = metrics_listen(listen_str);
+	if (sfd < 0) {
+		rc = sfd;
+		goto cleanup_sampler;
+	}
+
+	/* No SA_RESTART, so accept() returns on SIGINT or SIGTERM */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = metrics_signal;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+	pthread_mutex_init(&ctx.lock, NULL);
+
+	/*
+	 * The sampler inherits the mask with the signals blocked, so they are
+	 * delivered to this thread and interrupt accept().
+	 */
+	sigemptyset(&sigs);
+	sigaddset(&sigs, SIGINT);
+	sigaddset(&sigs, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &sigs, &old_sigs);
+
+	rc = pthread_create(&sampler, NULL, metrics_sampler, &ctx);
+
+	pthread_sigmask(SIG_SETMASK, &old_sigs, NULL);
+
+	if (rc) {
+		rc = -rc;
+		goto cleanup_sfd;
+	}
+
+	while (!metrics_stop) {
+		int conn;
+
+		conn = accept(sfd, NULL, NULL);
+		if (conn < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			rc = -errno;
+			metrics_stop = 1;
+			break;
+		}
+
+		metrics_respond(&ctx, conn, scrape_snap, scrape_valid);
+		close(conn);
+	}
+
+	pthread_join(sampler, NULL);
+
+cleanup_sfd:
+	pthread_mutex_destroy(&ctx.lock);
+	close(sfd);
+	if (!strncmp("unix:", listen_str, 5))
+		unlink(listen_str + 5);
+
+cleanup_sampler:
+	telemetry_sampler_destroy(&ctx.sampler);
+
+cleanup_mem:
+	free(scrape_valid);
+	free(scrape_snap);
+	free(ctx.valid);
+	free(ctx.snap);
+
+	return rc;
+}
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+
+struct pmbus_dev;
+
+int metrics_serve(struct pmbus_dev *devs, size_t ndevs, const char *listen,
+		  unsigned interval_ms);
+
+#endif
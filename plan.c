@@ -0,0 +1,248 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "plan.h"
+#include "pmbus.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Operations are compiled into a program with these properties:
+ *
+ * - Operations on distinct devices are independent, so each device's
+ *   operations are emitted together and cost at most one device selection.
+ * - Within a device, operations are split into segments of consecutive reads
+ *   or consecutive writes. Segments are never reordered, so a read observes
+ *   every write that preceded it in the original sequence.
+ * - Within a segment, accesses are grouped by page, starting with the page
+ *   selected at the end of the previous segment. Writes keep their relative
+ *   order within a page, and a write to PMBUS_PAGE_ALL stands alone.
+ * - Reads of the same register within a segment are merged into one access of
+ *   the widest requested width, and the value fanned out to each operation.
+ *
+ * Adjacent command codes are not merged into a single multi-byte read, as
+ * PMBus devices do not auto-increment across command codes.
+ */
+
+struct plan_ctx {
+	const struct plan_op *ops;
+	int page;
+};
+
+static int plan_page_key(const struct plan_ctx *ctx, const struct plan_op *op)
+{
+	return op->page == ctx->page ? -1 : op->page;
+}
+
+static int plan_cmp_read(const struct plan_ctx *ctx, uint16_t a, uint16_t b)
+{
+	const struct plan_op *x = &ctx->ops[a], *y = &ctx->ops[b];
+	int kx, ky;
+
+	kx = plan_page_key(ctx, x);
+	ky = plan_page_key(ctx, y);
+	if (kx != ky)
+		return kx - ky;
+
+	return x->reg - y->reg;
+}
+
+static int plan_cmp_write(const struct plan_ctx *ctx, uint16_t a, uint16_t b)
+{
+	return plan_page_key(ctx, &ctx->ops[a]) -
+	       plan_page_key(ctx, &ctx->ops[b]);
+}
+
+/* Stable, and segments are small */
+static void plan_sort(const struct plan_ctx *ctx, uint16_t *order, size_t n,
+		      int (*cmp)(const struct plan_ctx *, uint16_t, uint16_t))
+{
+	size_t i, j;
+
+	for (i = 1; i < n; i++) {
+		uint16_t tmp = order[i];
+
+		for (j = i; j > 0 && cmp(ctx, order[j - 1], tmp) > 0; j--)
+			order[j] = order[j - 1];
+
+		order[j] = tmp;
+	}
+}
+
+static bool plan_is_barrier(const struct plan_op *op)
+{
+	return op->write && op->page == PMBUS_PAGE_ALL;
+}
+
+static void plan_emit_segment(struct plan *plan, struct plan_ctx *ctx,
+			      uint16_t *order, size_t n)
+{
+	struct plan_step *prev = NULL;
+	size_t i;
+
+	if (ctx->ops[order[0]].write)
+		plan_sort(ctx, order, n, plan_cmp_write);
+	else
+		plan_sort(ctx, order, n, plan_cmp_read);
+
+	for (i = 0; i < n; i++) {
+		const struct plan_op *op = &ctx->ops[order[i]];
+		struct plan_step *step;
+
+		if (!op->write && prev && prev->page == op->page &&
+		    prev->reg == op->reg) {
+			step = prev;
+			if (op->width > step->width)
+				step->width = op->width;
+		} else {
+			step = &plan->steps[plan->nsteps++];
+			step->dev = op->dev;
+			step->page = op->page;
+			step->reg = op->reg;
+			step->width = op->width;
+			step->write = op->write;
+			step->val = op->val;
+			step->result = plan->nops;
+			step->nresults = 0;
+		}
+
+		if (!op->write) {
+			struct plan_result *res;
+
+			/* Results of a step are contiguous as reads sort by register */
+			res = &plan->results[step->result + step->nresults++];
+			res->op = order[i];
+			res->width = op->width;
+			plan->nops++;
+		}
+
+		prev = step;
+	}
+
+	ctx->page = plan->steps[plan->nsteps - 1].page;
+}
+
+static void plan_emit_device(struct plan *plan, const struct plan_op *ops,
+			     uint16_t *order, size_t n)
+{
+	struct plan_ctx ctx = { .ops = ops, .page = -1 };
+	size_t s, e;
+
+	for (s = 0; s < n; s = e) {
+		const struct plan_op *first = &ops[order[s]];
+
+		for (e = s + 1; e < n; e++) {
+			const struct plan_op *op = &ops[order[e]];
+
+			if (op->write != first->write || plan_is_barrier(op) ||
+			    plan_is_barrier(first))
+				break;
+		}
+
+		plan_emit_segment(plan, &ctx, &order[s], e - s);
+	}
+}
+
+int plan_compile(struct plan *plan, const struct plan_op *ops, size_t nops)
+{
+	bool seen[UINT8_MAX + 1] = { false };
+	uint16_t *order;
+	size_t i, j, n;
+
+	if (nops > UINT16_MAX)
+		return -EINVAL;
+
+	for (i = 0; i < nops; i++) {
+		if (ops[i].width != 1 && ops[i].width != 2)
+			return -EINVAL;
+	}
+
+	memset(plan, 0, sizeof(*plan));
+
+	plan->steps = calloc(nops ?: 1, sizeof(*plan->steps));
+	plan->results = calloc(nops ?: 1, sizeof(*plan->results));
+	order = calloc(nops ?: 1, sizeof(*order));
+	if (!plan->steps || !plan->results || !order) {
+		free(order);
+		plan_destroy(plan);
+		return -ENOMEM;
+	}
+
+	/* plan->nops counts read results as they are emitted */
+	for (i = 0; i < nops; i++) {
+		if (seen[ops[i].dev])
+			continue;
+
+		seen[ops[i].dev] = true;
+
+		for (j = i, n = 0; j < nops; j++) {
+			if (ops[j].dev == ops[i].dev)
+				order[n++] = j;
+		}
+
+		plan_emit_device(plan, ops, order, n);
+	}
+
+	free(order);
+
+	return 0;
+}
+
+void plan_destroy(struct plan *plan)
+{
+	free(plan->steps);
+	free(plan->results);
+	memset(plan, 0, sizeof(*plan));
+}
+
+/*
+ * Execute the plan, storing the value of each read operation at its index in
+ * @vals. Entries for write operations are left untouched.
+ */
+int plan_run(const struct plan *plan, struct pmbus_dev *devs, size_t ndevs,
+	     uint16_t *vals)
+{
+	size_t i, j;
+	int rc;
+
+	for (i = 0; i < plan->nsteps; i++) {
+		const struct plan_step *step = &plan->steps[i];
+		struct pmbus_dev *dev;
+
+		if (step->dev >= ndevs)
+			return -EINVAL;
+
+		dev = &devs[step->dev];
+
+		if (step->write) {
+			if (step->width == 1)
+				rc = pmbus_write_byte(dev, step->page, step->reg,
+						      step->val);
+			else
+				rc = pmbus_write_word(dev, step->page, step->reg,
+						      step->val);
+			if (rc < 0)
+				return rc;
+
+			continue;
+		}
+
+		if (step->width == 1)
+			rc = pmbus_read_byte(dev, step->page, step->reg);
+		else
+			rc = pmbus_read_word(dev, step->page, step->reg);
+		if (rc < 0)
+			return rc;
+
+		for (j = 0; j < step->nresults; j++) {
+			const struct plan_result *res;
+
+			res = &plan->results[step->result + j];
+			vals[res->op] = res->width == 1 ? rc & 0xff : rc;
+		}
+	}
+
+	return 0;
+}
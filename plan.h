@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct pmbus_dev;
+
+struct plan_op {
+	uint8_t dev;		/* Index into the devices passed to plan_run() */
+	uint8_t page;
+	uint8_t reg;
+	uint8_t width;		/* 1 or 2 bytes */
+	bool write;
+	uint16_t val;		/* Value to write */
+};
+
+struct plan_step {
+	uint8_t dev;
+	uint8_t page;
+	uint8_t reg;
+	uint8_t width;
+	bool write;
+	uint16_t val;
+	uint16_t result;	/* First entry of plan->results fed by a read */
+	uint16_t nresults;
+};
+
+struct plan_result {
+	uint16_t op;
+	uint8_t width;
+};
+
+/*
+ * A compiled plan is immutable and may be run any number of times, including
+ * concurrently on distinct sets of devices.
+ */
+struct plan {
+	struct plan_step *steps;
+	size_t nsteps;
+	struct plan_result *results;
+	size_t nops;
+};
+
+int plan_compile(struct plan *plan, const struct plan_op *ops, size_t nops);
+void plan_destroy(struct plan *plan);
+int plan_run(const struct plan *plan, struct pmbus_dev *devs, size_t ndevs,
+	     uint16_t *vals);
+
+#endif
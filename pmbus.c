@@ -5,34 +5,10 @@
 #include "pmbus.h"
 #include "smbus.h"
 
+#include <endian.h>
+#include <errno.h>
 #include <stdint.h>
-
-#define PMBUS_PAGE			0x00
-
-#define PMBUS_FAN_CONFIG_12		0x3a
-#define   PMBUS_FAN_CONFIG_1_ENABLED	BIT(7)
-#define   PMBUS_FAN_CONFIG_1_MODE	BIT(6)
-#define   PMBUS_FAN_CONFIG_1_PULSE	GENMASK(5, 4)
-#define   PMBUS_FAN_CONFIG_2_ENABLED	BIT(3)
-#define   PMBUS_FAN_CONFIG_2_MODE	BIT(2)
-#define   PMBUS_FAN_CONFIG_2_PULSE	GENMASK(1, 0)
-#define PMBUS_FAN_COMMAND_1		0x3b
-#define PMBUS_FAN_COMMAND_2		0x3c
-#define PMBUS_FAN_CONFIG_34		0x3d
-#define PMBUS_FAN_COMMAND_3		0x3e
-#define PMBUS_FAN_COMMAND_4		0x3f
-
-#define PMBUS_STATUS_BYTE		0x78
-#define PMBUS_STATUS_WORD		0x79
-#define PMBUS_STATUS_CML		0x7e
-#define PMBUS_STATUS_OTHER		0x7f
-#define PMBUS_STATUS_FANS_12		0x81
-#define PMBUS_STATUS_FANS_34		0x82
-
-#define PMBUS_READ_FAN_SPEED_1		0x90
-#define PMBUS_READ_FAN_SPEED_2		0x91
-#define PMBUS_READ_FAN_SPEED_3		0x92
-#define PMBUS_READ_FAN_SPEED_4		0x93
+#include <string.h>
 
 static const uint8_t pmbus_fan_config_reg_map[] = {
 	[pmbus_fan_1] = PMBUS_FAN_CONFIG_12,
@@ -62,6 +38,13 @@ static const uint8_t pmbus_fan_command_reg_map[] = {
 	[pmbus_fan_4] = PMBUS_FAN_COMMAND_4,
 };
 
+static const uint8_t pmbus_status_fans_reg_map[] = {
+	[pmbus_fan_1] = PMBUS_STATUS_FANS_12,
+	[pmbus_fan_2] = PMBUS_STATUS_FANS_12,
+	[pmbus_fan_3] = PMBUS_STATUS_FANS_34,
+	[pmbus_fan_4] = PMBUS_STATUS_FANS_34,
+};
+
 static const uint8_t pmbus_read_fan_speed_reg_map[] = {
 	[pmbus_fan_1] = PMBUS_READ_FAN_SPEED_1,
 	[pmbus_fan_2] = PMBUS_READ_FAN_SPEED_2,
@@ -69,51 +52,348 @@ static const uint8_t pmbus_read_fan_speed_reg_map[] = {
 	[pmbus_fan_4] = PMBUS_READ_FAN_SPEED_4,
 };
 
-int pmbus_read_byte(int fd, uint8_t page, uint8_t reg)
+void pmbus_dev_init(struct pmbus_dev *dev, struct smbus *bus, uint8_t addr)
+{
+	dev->bus = bus;
+	dev->addr = addr;
+	pmbus_dev_invalidate(dev);
+}
+
+void pmbus_dev_invalidate(struct pmbus_dev *dev)
+{
+	dev->page = -1;
+	memset(dev->cache, 0, sizeof(dev->cache));
+}
+
+/*
+ * FAN_CONFIG only changes when written by the host. FAN_COMMAND is also
+ * written by other hosts on the bus, so it keeps a slot but is never cached.
+ */
+const struct pmbus_cache_reg pmbus_cache_regs[PMBUS_CACHE_SLOTS] = {
+	{ PMBUS_FAN_CONFIG_12, 1, false },
+	{ PMBUS_FAN_CONFIG_34, 1, false },
+	{ PMBUS_FAN_COMMAND_1, 2, true },
+	{ PMBUS_FAN_COMMAND_2, 2, true },
+	{ PMBUS_FAN_COMMAND_3, 2, true },
+	{ PMBUS_FAN_COMMAND_4, 2, true },
+};
+
+static int pmbus_cache_slot(uint8_t reg)
+{
+	int slot;
+
+	for (slot = 0; slot < PMBUS_CACHE_SLOTS; slot++) {
+		if (pmbus_cache_regs[slot].reg == reg)
+			return slot;
+	}
+
+	return -1;
+}
+
+static int pmbus_cache_lookup(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+			      uint8_t width)
+{
+	int slot;
+
+	if (page >= PMBUS_PAGES)
+		return -1;
+
+	slot = pmbus_cache_slot(reg);
+	if (slot < 0 || pmbus_cache_regs[slot].width != width ||
+	    !(dev->cache[page].valid & BIT(slot)))
+		return -1;
+
+	return dev->cache[page].val[slot];
+}
+
+/* An access of the wrong width drops the entry rather than caching part of it */
+static void pmbus_cache_update(struct pmbus_dev *dev, uint8_t page,
+			       uint8_t reg, uint8_t width, uint16_t val)
+{
+	int slot;
+
+	slot = pmbus_cache_slot(reg);
+	if (slot < 0 || pmbus_cache_regs[slot].live)
+		return;
+
+	if (page == PMBUS_PAGE_ALL) {
+		for (page = 0; page < PMBUS_PAGES; page++)
+			dev->cache[page].valid &= ~BIT(slot);
+		return;
+	}
+
+	if (page >= PMBUS_PAGES)
+		return;
+
+	if (pmbus_cache_regs[slot].width != width) {
+		dev->cache[page].valid &= ~BIT(slot);
+		return;
+	}
+
+	dev->cache[page].val[slot] = val;
+	dev->cache[page].valid |= BIT(slot);
+}
+
+/*
+ * A page change and the following read are handed to the transport together
+ * so backends that support combined transfers can issue them as one.
+ */
+static int pmbus_read(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+		      void *buf, size_t len)
 {
 	int rc;
 
-	rc = smbus_write_byte(fd, PMBUS_PAGE, page);
+	if (dev->page == page)
+		return smbus_read(dev->bus, dev->addr, reg, buf, len);
+
+	rc = smbus_paged_read(dev->bus, dev->addr, PMBUS_PAGE, page, reg, buf,
+			      len);
+	dev->page = rc < 0 ? -1 : page;
+
+	return rc;
+}
+
+static int pmbus_set_page(struct pmbus_dev *dev, uint8_t page)
+{
+	int rc;
+
+	if (dev->page == page)
+		return 0;
+
+	rc = smbus_write_byte(dev->bus, dev->addr, PMBUS_PAGE, page);
+	if (rc < 0) {
+		dev->page = -1;
+		return rc;
+	}
+
+	dev->page = page;
+
+	return 0;
+}
+
+int pmbus_read_byte(struct pmbus_dev *dev, uint8_t page, uint8_t reg)
+{
+	uint8_t val;
+	int rc;
+
+	rc = pmbus_cache_lookup(dev, page, reg, 1);
+	if (rc >= 0)
+		return rc;
+
+	rc = pmbus_read(dev, page, reg, &val, sizeof(val));
 	if (rc < 0)
 		return rc;
 
-	return smbus_read_byte(fd, reg);
+	pmbus_cache_update(dev, page, reg, 1, val);
+
+	return val;
 }
 
-int pmbus_write_byte(int fd, uint8_t page, uint8_t reg, uint8_t val)
+int pmbus_write_byte(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+		     uint8_t val)
 {
 	int rc;
 
-	rc = smbus_write_byte(fd, PMBUS_PAGE, page);
+	if (reg == PMBUS_PAGE)
+		return pmbus_set_page(dev, val);
+
+	rc = pmbus_set_page(dev, page);
 	if (rc < 0)
 		return rc;
 
-	return smbus_write_byte(fd, reg, val);
+	rc = smbus_write_byte(dev->bus, dev->addr, reg, val);
+	if (rc < 0)
+		return rc;
+
+	pmbus_cache_update(dev, page, reg, 1, val);
+
+	return rc;
 }
 
-int pmbus_read_word(int fd, uint8_t page, uint8_t reg)
+int pmbus_read_word(struct pmbus_dev *dev, uint8_t page, uint8_t reg)
 {
+	uint16_t val;
 	int rc;
 
-	rc = smbus_write_byte(fd, PMBUS_PAGE, page);
+	rc = pmbus_cache_lookup(dev, page, reg, 2);
+	if (rc >= 0)
+		return rc;
+
+	rc = pmbus_read(dev, page, reg, &val, sizeof(val));
 	if (rc < 0)
 		return rc;
 
-	return smbus_read_word(fd, reg);
+	val = le16toh(val);
+	pmbus_cache_update(dev, page, reg, 2, val);
+
+	return val;
 }
 
-int pmbus_write_word(int fd, uint8_t page, uint8_t reg, uint16_t val)
+int pmbus_write_word(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+		     uint16_t val)
 {
 	int rc;
 
-	rc = smbus_write_byte(fd, PMBUS_PAGE, page);
+	rc = pmbus_set_page(dev, page);
 	if (rc < 0)
 		return rc;
 
-	return smbus_write_word(fd, reg, val);
+	rc = smbus_write_word(dev->bus, dev->addr, reg, val);
+	if (rc < 0)
+		return rc;
+
+	pmbus_cache_update(dev, page, reg, 2, val);
+
+	return rc;
 }
 
-int pmbus_fan_config_get_enabled(int fd, uint8_t page, enum pmbus_fan fan)
+ssize_t pmbus_read_block(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+			 uint8_t *buf, size_t len)
+{
+	int rc;
+
+	rc = pmbus_set_page(dev, page);
+	if (rc < 0)
+		return rc;
+
+	return smbus_read_block(dev->bus, dev->addr, reg, buf, len);
+}
+
+ssize_t pmbus_write_block(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+			  const uint8_t *buf, size_t len)
+{
+	int rc;
+
+	rc = pmbus_set_page(dev, page);
+	if (rc < 0)
+		return rc;
+
+	return smbus_write_block(dev->bus, dev->addr, reg, buf, len);
+}
+
+static void pmbus_regs_sort_run(struct pmbus_reg *regs, size_t n)
+{
+	size_t i, j;
+
+	for (i = 1; i < n; i++) {
+		struct pmbus_reg tmp = regs[i];
+
+		for (j = i; j > 0 && regs[j - 1].page > tmp.page; j--)
+			regs[j] = regs[j - 1];
+
+		regs[j] = tmp;
+	}
+}
+
+/*
+ * Stable insertion sort on page, so register accesses can be issued with one
+ * PAGE write per group while preserving the order of writes within a page.
+ * Entries on PMBUS_PAGE_ALL, and those @barrier (which may be NULL) selects,
+ * stay in place and nothing is moved across them.
+ */
+void pmbus_regs_sort(struct pmbus_reg *regs, size_t n,
+		     bool (*barrier)(const struct pmbus_reg *r))
+{
+	size_t i, start;
+
+	for (i = 0, start = 0; i < n; i++) {
+		if (regs[i].page != PMBUS_PAGE_ALL &&
+		    !(barrier && barrier(&regs[i])))
+			continue;
+
+		pmbus_regs_sort_run(&regs[start], i - start);
+		start = i + 1;
+	}
+
+	pmbus_regs_sort_run(&regs[start], n - start);
+}
+
+static int pmbus_read_reg(struct pmbus_dev *dev, struct pmbus_reg *r)
+{
+	int rc;
+
+	switch (r->width) {
+		case 1:
+			rc = pmbus_read_byte(dev, r->page, r->reg);
+			break;
+		case 2:
+			rc = pmbus_read_word(dev, r->page, r->reg);
+			break;
+		default:
+			return -EINVAL;
+	}
+
+	if (rc < 0)
+		return rc;
+
+	r->val = rc;
+
+	return 0;
+}
+
+/*
+ * Reads are independent of each other, so visit them a page at a time to
+ * cost one PAGE write per page touched. @regs itself is left in its order.
+ */
+int pmbus_read_regs(struct pmbus_dev *dev, struct pmbus_reg *regs, size_t n)
+{
+	uint32_t done;
+	size_t i, j;
+	int rc;
+
+	done = 0;
+	for (i = 0; i < n; i++) {
+		if (regs[i].page >= PMBUS_PAGES)
+			return -EINVAL;
+
+		if (done & BIT(regs[i].page))
+			continue;
+
+		done |= BIT(regs[i].page);
+
+		for (j = i; j < n; j++) {
+			if (regs[j].page != regs[i].page)
+				continue;
+
+			rc = pmbus_read_reg(dev, &regs[j]);
+			if (rc < 0)
+				return rc;
+		}
+	}
+
+	return 0;
+}
+
+/* Writes are issued in the order given, see pmbus_regs_sort() to group them */
+int pmbus_write_regs(struct pmbus_dev *dev, const struct pmbus_reg *regs,
+		     size_t n)
+{
+	size_t i;
+	int rc;
+
+	for (i = 0; i < n; i++) {
+		switch (regs[i].width) {
+			case 1:
+				rc = pmbus_write_byte(dev, regs[i].page, regs[i].reg,
+						      regs[i].val);
+				break;
+			case 2:
+				rc = pmbus_write_word(dev, regs[i].page, regs[i].reg,
+						      regs[i].val);
+				break;
+			default:
+				return -EINVAL;
+		}
+
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+int pmbus_fan_config_get_enabled(struct pmbus_dev *dev, uint8_t page,
+				 enum pmbus_fan fan)
 {
 	uint8_t reg, flag;
 	int rc;
@@ -121,14 +401,15 @@ int pmbus_fan_config_get_enabled(int fd, uint8_t page, enum pmbus_fan fan)
 	reg = pmbus_fan_config_reg_map[fan];
 	flag = pmbus_fan_config_enabled_map[fan];
 
-	rc = pmbus_read_byte(fd, page, reg);
+	rc = pmbus_read_byte(dev, page, reg);
 	if (rc < 0)
 		return rc;
 
 	return !!(rc & flag);
 }
 
-int pmbus_fan_config_get_mode(int fd, uint8_t page, enum pmbus_fan fan)
+int pmbus_fan_config_get_mode(struct pmbus_dev *dev, uint8_t page,
+			      enum pmbus_fan fan)
 {
 	uint8_t reg, flag;
 	int rc;
@@ -136,15 +417,15 @@ int pmbus_fan_config_get_mode(int fd, uint8_t page, enum pmbus_fan fan)
 	reg = pmbus_fan_config_reg_map[fan];
 	flag = pmbus_fan_config_mode_map[fan];
 
-	rc = pmbus_read_byte(fd, page, reg);
+	rc = pmbus_read_byte(dev, page, reg);
 	if (rc < 0)
 		return rc;
 
 	return rc & flag ? pmbus_fan_mode_rpm : pmbus_fan_mode_pwm;
 }
 
-int pmbus_fan_config_set_mode(int fd, uint8_t page, enum pmbus_fan fan,
-			      enum pmbus_fan_mode mode)
+int pmbus_fan_config_set_mode(struct pmbus_dev *dev, uint8_t page,
+			      enum pmbus_fan fan, enum pmbus_fan_mode mode)
 {
 	uint8_t reg, flag, val;
 	int rc;
@@ -152,7 +433,7 @@ int pmbus_fan_config_set_mode(int fd, uint8_t page, enum pmbus_fan fan,
 	reg = pmbus_fan_config_reg_map[fan];
 	flag = pmbus_fan_config_mode_map[fan];
 
-	rc = pmbus_read_byte(fd, page, reg);
+	rc = pmbus_read_byte(dev, page, reg);
 	if (rc < 0)
 		return rc;
 
@@ -160,21 +441,38 @@ int pmbus_fan_config_set_mode(int fd, uint8_t page, enum pmbus_fan fan,
 	val &= ~flag;
 	val |= mode * flag;
 
-	return pmbus_write_byte(fd, page, reg, val);
+	if (val == rc)
+		return 0;
+
+	return pmbus_write_byte(dev, page, reg, val);
+}
+
+int pmbus_fan_command_get(struct pmbus_dev *dev, uint8_t page,
+			  enum pmbus_fan fan)
+{
+	return pmbus_read_word(dev, page, pmbus_fan_command_reg_map[fan]);
+}
+
+int pmbus_fan_command_set(struct pmbus_dev *dev, uint8_t page,
+			  enum pmbus_fan fan, uint16_t rate)
+{
+	return pmbus_write_word(dev, page, pmbus_fan_command_reg_map[fan],
+				rate);
 }
 
-int pmbus_fan_command_get(int fd, uint8_t page, enum pmbus_fan fan)
+int pmbus_read_fan_speed(struct pmbus_dev *dev, uint8_t page,
+			 enum pmbus_fan fan)
 {
-	return pmbus_read_word(fd, page, pmbus_fan_command_reg_map[fan]);
+	return pmbus_read_word(dev, page, pmbus_read_fan_speed_reg_map[fan]);
 }
 
-int pmbus_fan_command_set(int fd, uint8_t page, enum pmbus_fan fan,
-			  uint16_t rate)
+int pmbus_read_status_word(struct pmbus_dev *dev, uint8_t page)
 {
-	return pmbus_write_word(fd, page, pmbus_fan_command_reg_map[fan], rate);
+	return pmbus_read_word(dev, page, PMBUS_STATUS_WORD);
 }
 
-int pmbus_read_fan_speed(int fd, uint8_t page, enum pmbus_fan fan)
+int pmbus_read_status_fans(struct pmbus_dev *dev, uint8_t page,
+			   enum pmbus_fan fan)
 {
-	return pmbus_read_word(fd, page, pmbus_read_fan_speed_reg_map[fan]);
+	return pmbus_read_byte(dev, page, pmbus_status_fans_reg_map[fan]);
 }
@@ -1,21 +1,139 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 /* Copyright (C) 2020 IBM Corp. */
 
+#ifndef PMBUS_H
+#define PMBUS_H
+
+#include "bits.h"
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+#define PMBUS_PAGE			0x00
+#define PMBUS_WRITE_PROTECT		0x10
+#define PMBUS_CAPABILITY		0x19
+#define PMBUS_VOUT_MODE			0x20
+#define PMBUS_VOUT_SCALE_MONITOR	0x2a
+
+#define PMBUS_FAN_CONFIG_12		0x3a
+#define   PMBUS_FAN_CONFIG_1_ENABLED	BIT(7)
+#define   PMBUS_FAN_CONFIG_1_MODE	BIT(6)
+#define   PMBUS_FAN_CONFIG_1_PULSE	GENMASK(5, 4)
+#define   PMBUS_FAN_CONFIG_2_ENABLED	BIT(3)
+#define   PMBUS_FAN_CONFIG_2_MODE	BIT(2)
+#define   PMBUS_FAN_CONFIG_2_PULSE	GENMASK(1, 0)
+#define PMBUS_FAN_COMMAND_1		0x3b
+#define PMBUS_FAN_COMMAND_2		0x3c
+#define PMBUS_FAN_CONFIG_34		0x3d
+#define PMBUS_FAN_COMMAND_3		0x3e
+#define PMBUS_FAN_COMMAND_4		0x3f
+
+#define PMBUS_VOUT_OV_FAULT_LIMIT	0x40
+#define PMBUS_VOUT_OV_WARN_LIMIT	0x42
+#define PMBUS_VOUT_UV_WARN_LIMIT	0x43
+#define PMBUS_VOUT_UV_FAULT_LIMIT	0x44
+#define PMBUS_OT_FAULT_LIMIT		0x4f
+#define PMBUS_OT_WARN_LIMIT		0x51
+
+#define PMBUS_STATUS_BYTE		0x78
+#define PMBUS_STATUS_WORD		0x79
+#define PMBUS_STATUS_VOUT		0x7a
+#define PMBUS_STATUS_CML		0x7e
+#define PMBUS_STATUS_OTHER		0x7f
+#define PMBUS_STATUS_MFR_SPECIFIC	0x80
+#define PMBUS_STATUS_FANS_12		0x81
+#define PMBUS_STATUS_FANS_34		0x82
+
+#define PMBUS_READ_VOUT			0x8b
+#define PMBUS_READ_TEMPERATURE_1	0x8d
+#define PMBUS_READ_FAN_SPEED_1		0x90
+#define PMBUS_READ_FAN_SPEED_2		0x91
+#define PMBUS_READ_FAN_SPEED_3		0x92
+#define PMBUS_READ_FAN_SPEED_4		0x93
+
+#define PMBUS_REVISION			0x98
+#define PMBUS_MFR_ID			0x99
+#define PMBUS_MFR_MODEL			0x9a
+#define PMBUS_MFR_REVISION		0x9b
+#define PMBUS_MFR_LOCATION		0x9c
+#define PMBUS_MFR_DATE			0x9d
+#define PMBUS_MFR_SERIAL		0x9e
+
+struct smbus;
 
 enum pmbus_fan_mode { pmbus_fan_mode_pwm, pmbus_fan_mode_rpm };
 enum pmbus_fan { pmbus_fan_1 = 1, pmbus_fan_2, pmbus_fan_3, pmbus_fan_4 };
 
-int pmbus_read_byte(int fd, uint8_t page, uint8_t reg);
-int pmbus_write_byte(int fd, uint8_t page, uint8_t reg, uint8_t val);
-int pmbus_read_word(int fd, uint8_t page, uint8_t reg);
-int pmbus_write_word(int fd, uint8_t page, uint8_t reg, uint16_t val);
-
-int pmbus_fan_config_get_enabled(int fd, uint8_t page, enum pmbus_fan fan);
-int pmbus_fan_config_get_mode(int fd, uint8_t page, enum pmbus_fan fan);
-int pmbus_fan_config_set_mode(int fd, uint8_t page, enum pmbus_fan fan,
-			      enum pmbus_fan_mode mode);
-int pmbus_fan_command_get(int fd, uint8_t page, enum pmbus_fan fan);
-int pmbus_fan_command_set(int fd, uint8_t page, enum pmbus_fan fan,
-			  uint16_t rate);
-int pmbus_read_fan_speed(int fd, uint8_t page, enum pmbus_fan fan);
+#define PMBUS_PAGES		32
+#define PMBUS_PAGE_ALL		0xff
+
+/* FAN_CONFIG_12, FAN_CONFIG_34 and FAN_COMMAND_1 to FAN_COMMAND_4 */
+#define PMBUS_CACHE_SLOTS	6
+
+struct pmbus_cache_reg {
+	uint8_t reg;
+	uint8_t width;
+	bool live;			/* Always read from the device */
+};
+
+extern const struct pmbus_cache_reg pmbus_cache_regs[PMBUS_CACHE_SLOTS];
+
+struct pmbus_page_cache {
+	uint16_t valid;			/* Bitmask of valid slots */
+	uint16_t val[PMBUS_CACHE_SLOTS];
+};
+
+struct pmbus_dev {
+	struct smbus *bus;
+	uint8_t addr;
+	int page;			/* Cached PAGE value, -1 if unknown */
+	struct pmbus_page_cache cache[PMBUS_PAGES];
+};
+
+struct pmbus_reg {
+	uint8_t page;
+	uint8_t reg;
+	uint8_t width;			/* 1 or 2 bytes */
+	uint16_t val;
+};
+
+void pmbus_dev_init(struct pmbus_dev *dev, struct smbus *bus, uint8_t addr);
+void pmbus_dev_invalidate(struct pmbus_dev *dev);
+
+int pmbus_read_byte(struct pmbus_dev *dev, uint8_t page, uint8_t reg);
+int pmbus_write_byte(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+		     uint8_t val);
+int pmbus_read_word(struct pmbus_dev *dev, uint8_t page, uint8_t reg);
+int pmbus_write_word(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+		     uint16_t val);
+
+ssize_t pmbus_read_block(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+			 uint8_t *buf, size_t len);
+ssize_t pmbus_write_block(struct pmbus_dev *dev, uint8_t page, uint8_t reg,
+			  const uint8_t *buf, size_t len);
+
+void pmbus_regs_sort(struct pmbus_reg *regs, size_t n,
+		     bool (*barrier)(const struct pmbus_reg *r));
+int pmbus_read_regs(struct pmbus_dev *dev, struct pmbus_reg *regs, size_t n);
+int pmbus_write_regs(struct pmbus_dev *dev, const struct pmbus_reg *regs,
+		     size_t n);
+
+int pmbus_fan_config_get_enabled(struct pmbus_dev *dev, uint8_t page,
+				 enum pmbus_fan fan);
+int pmbus_fan_config_get_mode(struct pmbus_dev *dev, uint8_t page,
+			      enum pmbus_fan fan);
+int pmbus_fan_config_set_mode(struct pmbus_dev *dev, uint8_t page,
+			      enum pmbus_fan fan, enum pmbus_fan_mode mode);
+int pmbus_fan_command_get(struct pmbus_dev *dev, uint8_t page,
+			  enum pmbus_fan fan);
+int pmbus_fan_command_set(struct pmbus_dev *dev, uint8_t page,
+			  enum pmbus_fan fan, uint16_t rate);
+int pmbus_read_fan_speed(struct pmbus_dev *dev, uint8_t page,
+			 enum pmbus_fan fan);
+int pmbus_read_status_word(struct pmbus_dev *dev, uint8_t page);
+int pmbus_read_status_fans(struct pmbus_dev *dev, uint8_t page,
+			   enum pmbus_fan fan);
+
+#endif
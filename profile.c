@@ -0,0 +1,193 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "pmbus.h"
+#include "profile.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static int64_t profile_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int profile_capture_init(struct profile_capture *cap, size_t max_samples)
+{
+	memset(cap, 0, sizeof(*cap));
+
+	/* Thinning needs at least two samples to make room */
+	if (max_samples < 2)
+		return -EINVAL;
+
+	cap->samples = calloc(max_samples, sizeof(*cap->samples));
+	if (!cap->samples)
+		return -ENOMEM;
+
+	cap->max_samples = max_samples;
+
+	return 0;
+}
+
+void profile_capture_destroy(struct profile_capture *cap)
+{
+	free(cap->samples);
+	memset(cap, 0, sizeof(*cap));
+}
+
+/* Drop every other sample, keeping the first */
+static void profile_thin(struct profile_capture *cap)
+{
+	size_t i;
+
+	for (i = 0; 2 * i < cap->nsamples; i++)
+		cap->samples[i] = cap->samples[2 * i];
+
+	cap->nsamples = i;
+	cap->stride *= 2;
+}
+
+/*
+ * Command a step and read the fan speed back-to-back for @duration_ms. The
+ * page is selected before the step, so each read costs a single transfer and
+ * is stamped at the midpoint of it. Every cap->stride'th read is kept, and
+ * once the capture is full it is thinned to half and the stride doubled, so
+ * the samples stay evenly spaced and always span the whole duration.
+ * Returns -EINTR if cap->stop is set before the capture completes.
+ */
+int profile_step(struct pmbus_dev *dev, uint8_t page, enum pmbus_fan fan,
+		 uint16_t command, unsigned duration_ms,
+		 struct profile_capture *cap)
+{
+	int64_t start, end;
+	unsigned long n;
+	int rc;
+
+	cap->nsamples = 0;
+	cap->stride = 1;
+
+	if (cap->stop && *cap->stop)
+		return -EINTR;
+
+	rc = pmbus_read_fan_speed(dev, page, fan);
+	if (rc < 0)
+		return rc;
+
+	cap->initial = rc;
+
+	start = profile_now();
+	rc = pmbus_fan_command_set(dev, page, fan, command);
+	end = profile_now();
+	if (rc < 0)
+		return rc;
+
+	cap->t0_ns = start + (end - start) / 2;
+
+	end = cap->t0_ns + (int64_t)duration_ms * 1000000;
+	for (n = 0; ; n++) {
+		struct profile_sample *s;
+		int64_t after;
+
+		if (cap->stop && *cap->stop)
+			return -EINTR;
+
+		start = profile_now();
+		if (start >= end)
+			break;
+
+		rc = pmbus_read_fan_speed(dev, page, fan);
+		after = profile_now();
+		if (rc < 0)
+			return rc;
+
+		if (n % cap->stride)
+			continue;
+
+		if (cap->nsamples == cap->max_samples) {
+			profile_thin(cap);
+			if (n % cap->stride)
+				continue;
+		}
+
+		s = &cap->samples[cap->nsamples];
+		s->t_ns = start + (after - start) / 2;
+		s->rpm = rc;
+		cap->nsamples++;
+	}
+
+	return 0;
+}
+
+/*
+ * Time to 90% is measured against the step from the initial to the final
+ * speed. The response has settled once it stays within @band_pct percent of
+ * the final speed until the end of the capture.
+ */
+int profile_analyse(const struct profile_capture *cap, unsigned band_pct,
+		    struct profile_result *res)
+{
+	const struct profile_sample *s = cap->samples;
+	size_t n = cap->nsamples;
+	int32_t delta, dir, peak;
+	size_t tail, i, last;
+	int64_t sum;
+	int32_t band;
+
+	if (n < 2)
+		return -EINVAL;
+
+	memset(res, 0, sizeof(*res));
+
+	tail = n / 10 ?: 1;
+	for (i = n - tail, sum = 0; i < n; i++)
+		sum += s[i].rpm;
+
+	res->initial = cap->initial;
+	res->final = (sum + tail / 2) / tail;
+	res->period_ns = (s[n - 1].t_ns - s[0].t_ns) / (int64_t)(n - 1);
+
+	delta = (int32_t)res->final - res->initial;
+	dir = delta < 0 ? -1 : 1;
+
+	for (i = 0, peak = 0; i < n; i++) {
+		int32_t progress = ((int32_t)s[i].rpm - res->initial) * dir;
+		int32_t excess = ((int32_t)s[i].rpm - res->final) * dir;
+
+		if (delta && !res->reached && 10 * progress >= 9 * delta * dir) {
+			res->reached = true;
+			res->t90_ns = s[i].t_ns - cap->t0_ns;
+		}
+
+		if (excess > peak)
+			peak = excess;
+	}
+
+	if (delta)
+		res->overshoot = 100.0f * peak / (delta * dir);
+
+	band = res->final * band_pct / 100;
+	for (i = n, last = n; i > 0; i--) {
+		int32_t err = (int32_t)s[i - 1].rpm - res->final;
+
+		if (err > band || err < -band) {
+			last = i - 1;
+			break;
+		}
+	}
+
+	if (last == n) {
+		res->settled = true;
+		res->settle_ns = s[0].t_ns - cap->t0_ns;
+	} else if (last < n - 1) {
+		res->settled = true;
+		res->settle_ns = s[last + 1].t_ns - cap->t0_ns;
+	}
+
+	return 0;
+}
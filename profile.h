@@ -0,0 +1,50 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "pmbus.h"
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+struct profile_sample {
+	int64_t t_ns;		/* CLOCK_MONOTONIC at the midpoint of the read */
+	uint16_t rpm;
+};
+
+struct profile_capture {
+	int64_t t0_ns;		/* Midpoint of the FAN_COMMAND write */
+	uint16_t initial;	/* Speed read just before the step */
+	size_t nsamples;
+	size_t max_samples;
+	unsigned long stride;	/* Reads per sample, doubled when full */
+	struct profile_sample *samples;
+	const volatile sig_atomic_t *stop;	/* Abandons steps when set */
+};
+
+struct profile_result {
+	uint16_t initial;
+	uint16_t final;		/* Mean of the last tenth of the capture */
+	bool reached;		/* Crossed 90% of the step */
+	int64_t t90_ns;
+	float overshoot;	/* Percent of the step, 0 if none */
+	bool settled;
+	int64_t settle_ns;
+	int64_t period_ns;	/* Mean interval between samples */
+};
+
+int profile_capture_init(struct profile_capture *cap, size_t max_samples);
+void profile_capture_destroy(struct profile_capture *cap);
+
+int profile_step(struct pmbus_dev *dev, uint8_t page, enum pmbus_fan fan,
+		 uint16_t command, unsigned duration_ms,
+		 struct profile_capture *cap);
+
+int profile_analyse(const struct profile_capture *cap, unsigned band_pct,
+		    struct profile_result *res);
+
+#endif
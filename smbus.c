@@ -1,139 +1,280 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2020 IBM Corp.
 
-#include "ds3900.h"
 #include "smbus.h"
 
+#include <endian.h>
 #include <errno.h>
 #include <stddef.h>
-#include <stdlib.h>
+#include <string.h>
 
-ssize_t smbus_read_byte(int fd, uint8_t reg)
+/* CRC-8 with the polynomial x^8 + x^2 + x + 1, indexed by crc ^ byte */
+static const uint8_t smbus_crc8_table[256] = {
+	0x00, 0x07, 0x0e, 0x09, 0x1c, 0x1b, 0x12, 0x15,
+	0x38, 0x3f, 0x36, 0x31, 0x24, 0x23, 0x2a, 0x2d,
+	0x70, 0x77, 0x7e, 0x79, 0x6c, 0x6b, 0x62, 0x65,
+	0x48, 0x4f, 0x46, 0x41, 0x54, 0x53, 0x5a, 0x5d,
+	0xe0, 0xe7, 0xee, 0xe9, 0xfc, 0xfb, 0xf2, 0xf5,
+	0xd8, 0xdf, 0xd6, 0xd1, 0xc4, 0xc3, 0xca, 0xcd,
+	0x90, 0x97, 0x9e, 0x99, 0x8c, 0x8b, 0x82, 0x85,
+	0xa8, 0xaf, 0xa6, 0xa1, 0xb4, 0xb3, 0xba, 0xbd,
+	0xc7, 0xc0, 0xc9, 0xce, 0xdb, 0xdc, 0xd5, 0xd2,
+	0xff, 0xf8, 0xf1, 0xf6, 0xe3, 0xe4, 0xed, 0xea,
+	0xb7, 0xb0, 0xb9, 0xbe, 0xab, 0xac, 0xa5, 0xa2,
+	0x8f, 0x88, 0x81, 0x86, 0x93, 0x94, 0x9d, 0x9a,
+	0x27, 0x20, 0x29, 0x2e, 0x3b, 0x3c, 0x35, 0x32,
+	0x1f, 0x18, 0x11, 0x16, 0x03, 0x04, 0x0d, 0x0a,
+	0x57, 0x50, 0x59, 0x5e, 0x4b, 0x4c, 0x45, 0x42,
+	0x6f, 0x68, 0x61, 0x66, 0x73, 0x74, 0x7d, 0x7a,
+	0x89, 0x8e, 0x87, 0x80, 0x95, 0x92, 0x9b, 0x9c,
+	0xb1, 0xb6, 0xbf, 0xb8, 0xad, 0xaa, 0xa3, 0xa4,
+	0xf9, 0xfe, 0xf7, 0xf0, 0xe5, 0xe2, 0xeb, 0xec,
+	0xc1, 0xc6, 0xcf, 0xc8, 0xdd, 0xda, 0xd3, 0xd4,
+	0x69, 0x6e, 0x67, 0x60, 0x75, 0x72, 0x7b, 0x7c,
+	0x51, 0x56, 0x5f, 0x58, 0x4d, 0x4a, 0x43, 0x44,
+	0x19, 0x1e, 0x17, 0x10, 0x05, 0x02, 0x0b, 0x0c,
+	0x21, 0x26, 0x2f, 0x28, 0x3d, 0x3a, 0x33, 0x34,
+	0x4e, 0x49, 0x40, 0x47, 0x52, 0x55, 0x5c, 0x5b,
+	0x76, 0x71, 0x78, 0x7f, 0x6a, 0x6d, 0x64, 0x63,
+	0x3e, 0x39, 0x30, 0x37, 0x22, 0x25, 0x2c, 0x2b,
+	0x06, 0x01, 0x08, 0x0f, 0x1a, 0x1d, 0x14, 0x13,
+	0xae, 0xa9, 0xa0, 0xa7, 0xb2, 0xb5, 0xbc, 0xbb,
+	0x96, 0x91, 0x98, 0x9f, 0x8a, 0x8d, 0x84, 0x83,
+	0xde, 0xd9, 0xd0, 0xd7, 0xc2, 0xc5, 0xcc, 0xcb,
+	0xe6, 0xe1, 0xe8, 0xef, 0xfa, 0xfd, 0xf4, 0xf3,
+};
+
+void smbus_init(struct smbus *bus, const struct smbus_ops *ops)
+{
+	bus->ops = ops;
+	bus->quirks = 0;
+	bus->pec = false;
+	bus->pec_retries = 0;
+	bus->pec_errors = 0;
+}
+
+void smbus_set_pec(struct smbus *bus, bool enable, unsigned retries)
+{
+	bus->pec = enable;
+	bus->pec_retries = retries;
+}
+
+/* Fold @buf into a running PEC, starting from 0 */
+uint8_t smbus_pec_update(uint8_t crc, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len--)
+		crc = smbus_crc8_table[crc ^ *p++];
+
+	return crc;
+}
+
+/* The PEC of the address and command bytes that start a write */
+static uint8_t smbus_pec_write_start(uint8_t dev, uint8_t reg)
+{
+	const uint8_t start[] = { dev << 1, reg };
+
+	return smbus_pec_update(0, start, sizeof(start));
+}
+
+/* As above, plus the repeated start's address byte that begins a read */
+static uint8_t smbus_pec_read_start(uint8_t dev, uint8_t reg)
+{
+	const uint8_t start[] = { dev << 1, reg, (dev << 1) | 1 };
+
+	return smbus_pec_update(0, start, sizeof(start));
+}
+
+/* Read @len bytes plus the PEC, repeating the read only when it doesn't match */
+static int smbus_pec_read(struct smbus *bus, uint8_t dev, uint8_t reg,
+			  void *buf, size_t len)
+{
+	uint8_t rx[SMBUS_BLOCK_MAX + 1];
+	unsigned attempt;
+	int rc;
+
+	if (!len || len > SMBUS_BLOCK_MAX)
+		return -EINVAL;
+
+	for (attempt = 0; ; attempt++) {
+		rc = bus->ops->read(bus, dev, reg, rx, len + 1);
+		if (rc < 0)
+			return rc;
+
+		if (smbus_pec_update(smbus_pec_read_start(dev, reg), rx, len) ==
+		    rx[len])
+			break;
+
+		bus->pec_errors++;
+		if (attempt == bus->pec_retries)
+			return -EBADMSG;
+	}
+
+	memcpy(buf, rx, len);
+
+	return 0;
+}
+
+int smbus_read(struct smbus *bus, uint8_t dev, uint8_t reg, void *buf,
+	       size_t len)
+{
+	if (bus->pec)
+		return smbus_pec_read(bus, dev, reg, buf, len);
+
+	return bus->ops->read(bus, dev, reg, buf, len);
+}
+
+/*
+ * A write can't be verified from our side: a device that sees a bad PEC
+ * NACKs it or flags a CML fault, so writes are never retried here.
+ */
+int smbus_write(struct smbus *bus, uint8_t dev, uint8_t reg, const void *buf,
+		size_t len)
+{
+	uint8_t tx[SMBUS_BLOCK_MAX + 1];
+
+	if (!bus->pec)
+		return bus->ops->write(bus, dev, reg, buf, len);
+
+	if (!len || len > SMBUS_BLOCK_MAX)
+		return -EINVAL;
+
+	memcpy(tx, buf, len);
+	tx[len] = smbus_pec_update(smbus_pec_write_start(dev, reg), buf, len);
+
+	return bus->ops->write(bus, dev, reg, tx, len + 1);
+}
+
+/*
+ * A PAGE write with a PEC followed by a repeated start isn't an SMBus
+ * protocol, so a device need not check it. With PEC enabled the PAGE write
+ * and the read go out as separate transactions instead.
+ */
+int smbus_paged_read(struct smbus *bus, uint8_t dev, uint8_t page_reg,
+		     uint8_t page, uint8_t reg, void *buf, size_t len)
+{
+	int rc;
+
+	if (bus->ops->paged_read && !bus->pec)
+		return bus->ops->paged_read(bus, dev, page_reg, &page,
+					    sizeof(page), reg, buf, len);
+
+	rc = smbus_write(bus, dev, page_reg, &page, sizeof(page));
+	if (rc < 0)
+		return rc;
+
+	return smbus_read(bus, dev, reg, buf, len);
+}
+
+ssize_t smbus_read_byte(struct smbus *bus, uint8_t dev, uint8_t reg)
 {
-	struct ds3900_cmd cmd;
 	uint8_t val;
 	int rc;
 
-	cmd = ds3900_cmd_packet_read;
-	ds3900_packet_op(&cmd, reg, sizeof(val));
-	rc = ds3900_xfer(fd, cmd, &val, sizeof(val));
+	rc = smbus_read(bus, dev, reg, &val, sizeof(val));
 	if (rc < 0)
 		return rc;
 
 	return val;
 }
 
-ssize_t smbus_write_byte(int fd, uint8_t reg, uint8_t val)
+ssize_t smbus_write_byte(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 uint8_t val)
 {
-	struct ds3900_cmd cmd;
-
-	cmd = ds3900_cmd_packet_write;
-	ds3900_packet_op(&cmd, reg, sizeof(val));
-	return ds3900_xfer(fd, cmd, &val, sizeof(val));
+	return smbus_write(bus, dev, reg, &val, sizeof(val));
 }
 
-ssize_t smbus_read_word(int fd, uint8_t reg)
+ssize_t smbus_read_word(struct smbus *bus, uint8_t dev, uint8_t reg)
 {
-	struct ds3900_cmd cmd;
 	uint16_t val;
 	int rc;
 
-	cmd = ds3900_cmd_packet_read;
-	ds3900_packet_op(&cmd, reg, sizeof(val));
-	rc = ds3900_xfer(fd, cmd, &val, sizeof(val));
+	rc = smbus_read(bus, dev, reg, &val, sizeof(val));
 	if (rc < 0)
 		return rc;
 
-	return le32toh(val);
+	return le16toh(val);
 }
 
-ssize_t smbus_write_word(int fd, uint8_t reg, uint16_t val)
+ssize_t smbus_write_word(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 uint16_t val)
 {
-	struct ds3900_cmd cmd;
+	val = htole16(val);
 
-	cmd = ds3900_cmd_packet_write;
-	ds3900_packet_op(&cmd, reg, sizeof(val));
-	return ds3900_xfer(fd, cmd, &val, sizeof(val));
+	return smbus_write(bus, dev, reg, &val, sizeof(val));
 }
 
-/* Something's wrong with this, all data bytes are 0xff */
-ssize_t smbus_read_block(int fd, uint8_t dev, uint8_t reg,
-				uint8_t **buf, size_t len)
+/*
+ * Returns the block length reported by the device, or -EOVERFLOW if it did not
+ * fit in @len bytes. A @len of SMBUS_BLOCK_MAX always suffices.
+ */
+ssize_t smbus_read_block(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 uint8_t *buf, size_t len)
 {
-	struct ds3900_cmd cmd;
+	uint8_t rx[SMBUS_BLOCK_MAX + 1];
+	unsigned attempt;
 	uint8_t count;
-	int rc;
+	ssize_t rc;
 
-	if (!buf)
-		return -EINVAL;
+	if (!bus->ops->read_block)
+		return -EOPNOTSUPP;
 
-	if (!(*buf) && len)
+	if (!bus->pec)
+		return bus->ops->read_block(bus, dev, reg, buf, len);
+
+	if (!buf && len)
 		return -EINVAL;
 
-	/* Start */
-	rc = ds3900_xfer(fd, ds3900_cmd_2wire_start, NULL, 0);
-	if (rc < 0)
-		return rc;
+	/* Take the whole block, as the PEC covers all of it */
+	for (attempt = 0; ; attempt++) {
+		uint8_t crc;
 
-	/* Address with Write*/
-	cmd = ds3900_cmd_2wire_write_byte;
-	cmd.cmd.data = (dev << 1) | 0;
-	rc = ds3900_xfer(fd, cmd, NULL, 0);
-	if (rc < 0)
-		goto cleanup_bus;
+		rc = bus->ops->read_block(bus, dev, reg, rx, sizeof(rx));
+		if (rc < 0)
+			return rc;
 
-	/* Command Code */
-	cmd = ds3900_cmd_2wire_write_byte;
-	cmd.cmd.data = reg;
-	rc = ds3900_xfer(fd, cmd, NULL, 0);
-	if (rc < 0)
-		goto cleanup_bus;
+		count = rc;
+		crc = smbus_pec_update(smbus_pec_read_start(dev, reg), &count,
+				       sizeof(count));
+		if (smbus_pec_update(crc, rx, count) == rx[count])
+			break;
 
-	/* Start Repeat */
-	rc = ds3900_xfer(fd, ds3900_cmd_2wire_start, NULL, 0);
-	if (rc < 0)
-		goto cleanup_bus;
+		bus->pec_errors++;
+		if (attempt == bus->pec_retries)
+			return -EBADMSG;
+	}
 
-	/* Address with Read */
-	cmd = ds3900_cmd_2wire_write_byte;
-	cmd.cmd.data = (dev << 1) | 1;
-	rc = ds3900_xfer(fd, cmd, NULL, 0);
-	if (rc < 0)
-		goto cleanup_bus;
+	if (count > len)
+		return -EOVERFLOW;
 
-	/* Count */
-	cmd = ds3900_cmd_2wire_read_byte;
-	cmd.cmd.data = DS3900_CMD_2WIRE_READ_BYTE_ACK;
-	rc = ds3900_xfer(fd, cmd, &count, sizeof(count));
-	if (rc < 0)
-		goto cleanup_bus;
-
-	/* Allocate buffer space */
-	if (count > len) {
-		uint8_t *new_buf = realloc(*buf, count);
-		if (!new_buf) {
-			rc = -ENOMEM;
-			goto cleanup_bus;
-		}
-		*buf = new_buf;
-	}
+	memcpy(buf, rx, count);
 
-	/* Read data */
-	len = count;
-	while (len--) {
-		cmd = ds3900_cmd_2wire_read_byte;
-		cmd.cmd.data = !!len; /* ACK while there's another byte */
-		rc = ds3900_xfer(fd, cmd, &(*buf)[count - (len + 1)], sizeof(**buf));
-		if (rc < 0)
-			goto cleanup_bus;
-	}
+	return count;
+}
+
+ssize_t smbus_write_block(struct smbus *bus, uint8_t dev, uint8_t reg,
+			  const uint8_t *buf, size_t len)
+{
+	uint8_t tx[SMBUS_BLOCK_MAX + 1];
+	uint8_t count = len;
+
+	if (!bus->ops->write_block)
+		return -EOPNOTSUPP;
 
-	rc = ds3900_xfer(fd, ds3900_cmd_2wire_stop, NULL, 0);
-	if (!rc)
-		return count;
+	if (len > SMBUS_BLOCK_MAX)
+		return -EINVAL;
+
+	if (!bus->pec)
+		return bus->ops->write_block(bus, dev, reg, buf, len);
+
+	if (!buf && len)
+		return -EINVAL;
 
-cleanup_bus:
-	ds3900_xfer(fd, ds3900_cmd_2wire_recover, NULL, 0);
+	memcpy(tx, buf, len);
+	tx[len] = smbus_pec_update(smbus_pec_update(smbus_pec_write_start(dev, reg),
+						    &count, sizeof(count)),
+				   buf, len);
 
-	return rc;
+	return bus->ops->write_block(bus, dev, reg, tx, len);
 }
@@ -1,12 +1,75 @@
 /* SPDX-License-Identifier: Apache-2.0 */
 /* Copyright (C) 2020 IBM Corp. */
 
+#ifndef SMBUS_H
+#define SMBUS_H
+
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
 
-ssize_t smbus_read_byte(int fd, uint8_t reg);
-ssize_t smbus_write_byte(int fd, uint8_t reg, uint8_t val);
-ssize_t smbus_read_word(int fd, uint8_t reg);
-ssize_t smbus_write_word(int fd, uint8_t reg, uint16_t val);
-ssize_t smbus_read_block(int fd, uint8_t dev, uint8_t reg, uint8_t **buf,
-			 size_t len);
+#define SMBUS_BLOCK_MAX	32
+
+struct smbus;
+
+/*
+ * Transport backends embed a struct smbus and provide these operations.
+ * paged_read is optional: backends that can issue the PAGE write and the
+ * register read as a single bus transaction should implement it.
+ *
+ * PEC is generated and checked by the generic layer, which passes the PEC
+ * byte to read and write as an extra data byte. paged_read isn't used while
+ * PEC is enabled. The block operations can't do the same as the count byte
+ * excludes the PEC, so when bus->pec is set they transfer one byte beyond
+ * the block data in @buf.
+ */
+struct smbus_ops {
+	int (*read)(struct smbus *bus, uint8_t dev, uint8_t reg, void *buf,
+		    size_t len);
+	int (*write)(struct smbus *bus, uint8_t dev, uint8_t reg,
+		     const void *buf, size_t len);
+	int (*paged_read)(struct smbus *bus, uint8_t dev, uint8_t page_reg,
+			  const void *page, size_t page_len, uint8_t reg,
+			  void *buf, size_t len);
+	ssize_t (*read_block)(struct smbus *bus, uint8_t dev, uint8_t reg,
+			      uint8_t *buf, size_t len);
+	ssize_t (*write_block)(struct smbus *bus, uint8_t dev, uint8_t reg,
+			       const uint8_t *buf, size_t len);
+};
+
+/* Block reads complete but return corrupt data */
+#define SMBUS_QUIRK_BAD_READ_BLOCK	(1U << 0)
+
+struct smbus {
+	const struct smbus_ops *ops;
+	unsigned quirks;
+	bool pec;
+	unsigned pec_retries;	/* Reads repeated after a PEC mismatch */
+	unsigned long pec_errors;
+};
+
+void smbus_init(struct smbus *bus, const struct smbus_ops *ops);
+void smbus_set_pec(struct smbus *bus, bool enable, unsigned retries);
+
+uint8_t smbus_pec_update(uint8_t crc, const void *buf, size_t len);
+
+int smbus_read(struct smbus *bus, uint8_t dev, uint8_t reg, void *buf,
+	       size_t len);
+int smbus_write(struct smbus *bus, uint8_t dev, uint8_t reg, const void *buf,
+		size_t len);
+int smbus_paged_read(struct smbus *bus, uint8_t dev, uint8_t page_reg,
+		     uint8_t page, uint8_t reg, void *buf, size_t len);
+
+ssize_t smbus_read_byte(struct smbus *bus, uint8_t dev, uint8_t reg);
+ssize_t smbus_write_byte(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 uint8_t val);
+ssize_t smbus_read_word(struct smbus *bus, uint8_t dev, uint8_t reg);
+ssize_t smbus_write_word(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 uint16_t val);
+ssize_t smbus_read_block(struct smbus *bus, uint8_t dev, uint8_t reg,
+			 uint8_t *buf, size_t len);
+ssize_t smbus_write_block(struct smbus *bus, uint8_t dev, uint8_t reg,
+			  const uint8_t *buf, size_t len);
+
+#endif
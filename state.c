@@ -0,0 +1,312 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "max31785.h"
+#include "pmbus.h"
+#include "smbus.h"
+#include "state.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define STATE_HDR_LEN		8
+#define STATE_PAGE_LEN		(2 * (1 + PMBUS_CACHE_SLOTS))
+#define STATE_RECORD_LEN	(8 + PMBUS_PAGES * STATE_PAGE_LEN)
+#define STATE_DEVICES_MAX	UINT8_MAX
+
+static void state_put_le16(uint8_t *buf, uint16_t v)
+{
+	buf[0] = v & 0xff;
+	buf[1] = v >> 8;
+}
+
+static uint16_t state_get_le16(const uint8_t *buf)
+{
+	return buf[0] | buf[1] << 8;
+}
+
+/* Global registers, so read on whichever page is selected */
+static int state_fingerprint(struct pmbus_dev *dev, uint16_t *revision,
+			     uint16_t *mode)
+{
+	uint8_t page = dev->page < 0 ? 0 : dev->page;
+	int rc;
+
+	rc = pmbus_read_word(dev, page, PMBUS_MFR_REVISION);
+	if (rc < 0)
+		return rc;
+
+	*revision = rc;
+
+	rc = pmbus_read_word(dev, page, MAX31785_MFR_MODE);
+	if (rc < 0)
+		return rc;
+
+	*mode = rc;
+
+	return 0;
+}
+
+/*
+ * Write the register cache of each device to @path, replacing it atomically.
+ * Devices whose fingerprint can't be read are left out.
+ */
+int state_save(const char *path, struct pmbus_dev *devs, size_t ndevs)
+{
+	char tmp[PATH_MAX];
+	size_t i, n, len;
+	uint8_t *buf;
+	int fd, rc;
+
+	if (ndevs > STATE_DEVICES_MAX)
+		return -EINVAL;
+
+	if ((size_t)snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= sizeof(tmp))
+		return -ENAMETOOLONG;
+
+	buf = calloc(1, STATE_HDR_LEN + ndevs * STATE_RECORD_LEN);
+	if (!buf)
+		return -ENOMEM;
+
+	for (i = 0, n = 0; i < ndevs; i++) {
+		uint8_t *rec = &buf[STATE_HDR_LEN + n * STATE_RECORD_LEN];
+		struct pmbus_dev *dev = &devs[i];
+		uint16_t revision, mode;
+		size_t page, slot;
+
+		if (state_fingerprint(dev, &revision, &mode) < 0)
+			continue;
+
+		rec[0] = dev->addr;
+		state_put_le16(&rec[2], revision);
+		state_put_le16(&rec[4], mode);
+
+		for (page = 0; page < PMBUS_PAGES; page++) {
+			const struct pmbus_page_cache *cache = &dev->cache[page];
+			uint8_t *p = &rec[8 + page * STATE_PAGE_LEN];
+
+			state_put_le16(&p[0], cache->valid);
+			for (slot = 0; slot < PMBUS_CACHE_SLOTS; slot++)
+				state_put_le16(&p[2 + 2 * slot], cache->val[slot]);
+		}
+
+		n++;
+	}
+
+	memcpy(buf, STATE_MAGIC, 4);
+	buf[4] = STATE_VERSION;
+	buf[5] = n;
+	len = STATE_HDR_LEN + n * STATE_RECORD_LEN;
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		rc = -errno;
+		goto cleanup_buf;
+	}
+
+	rc = write(fd, buf, len);
+	if (rc < 0)
+		rc = -errno;
+	else if ((size_t)rc != len)
+		rc = -EIO;
+	else if (fsync(fd) < 0)
+		rc = -errno;
+	else
+		rc = 0;
+
+	if (close(fd) < 0 && !rc)
+		rc = -errno;
+
+	if (!rc && rename(tmp, path) < 0)
+		rc = -errno;
+
+	if (rc < 0)
+		unlink(tmp);
+
+cleanup_buf:
+	free(buf);
+
+	return rc;
+}
+
+/* Read one cached register back and compare it with the record's value */
+static int state_spot_check(struct pmbus_dev *dev, const uint8_t *rec,
+			    size_t page, size_t slot)
+{
+	const struct pmbus_cache_reg *r = &pmbus_cache_regs[slot];
+	uint16_t want;
+	int rc;
+
+	want = state_get_le16(&rec[8 + page * STATE_PAGE_LEN + 2 + 2 * slot]);
+
+	if (r->width == 1)
+		rc = pmbus_read_byte(dev, page, r->reg);
+	else
+		rc = pmbus_read_word(dev, page, r->reg);
+	if (rc < 0)
+		return rc;
+
+	return rc == want;
+}
+
+/* Valid bits of a page in @rec, ignoring slots that are never cached */
+static uint16_t state_valid(const uint8_t *rec, size_t page)
+{
+	uint16_t valid = state_get_le16(&rec[8 + page * STATE_PAGE_LEN]);
+	size_t slot;
+
+	for (slot = 0; slot < PMBUS_CACHE_SLOTS; slot++) {
+		if (pmbus_cache_regs[slot].live)
+			valid &= ~BIT(slot);
+	}
+
+	return valid;
+}
+
+/*
+ * Check the record against the device with a handful of reads: PAGE, the
+ * fingerprint, and the first and last cached registers. The last is checked
+ * first so the device is left on the lowest cached page, where a walk over
+ * the fan pages starts. Returns 1 if the record matches, with the device's
+ * page known but its cache still empty.
+ */
+static int state_validate(struct pmbus_dev *dev, const uint8_t *rec)
+{
+	int first_page = -1, last_page = -1;
+	size_t first_slot = 0, last_slot = 0;
+	uint16_t revision, mode;
+	size_t page, slot;
+	int rc;
+
+	pmbus_dev_invalidate(dev);
+
+	rc = smbus_read_byte(dev->bus, dev->addr, PMBUS_PAGE);
+	if (rc < 0)
+		return rc;
+
+	dev->page = rc;
+
+	rc = state_fingerprint(dev, &revision, &mode);
+	if (rc < 0)
+		return rc;
+
+	if (revision != state_get_le16(&rec[2]) || mode != state_get_le16(&rec[4]))
+		return 0;
+
+	for (page = 0; page < PMBUS_PAGES; page++) {
+		uint16_t valid = state_valid(rec, page);
+
+		for (slot = 0; slot < PMBUS_CACHE_SLOTS; slot++) {
+			if (!(valid & BIT(slot)))
+				continue;
+
+			if (first_page < 0) {
+				first_page = page;
+				first_slot = slot;
+			}
+
+			last_page = page;
+			last_slot = slot;
+		}
+	}
+
+	if (first_page < 0)
+		return 1;
+
+	rc = state_spot_check(dev, rec, last_page, last_slot);
+	if (rc <= 0)
+		return rc;
+
+	if (last_page == first_page && last_slot == first_slot)
+		return 1;
+
+	return state_spot_check(dev, rec, first_page, first_slot);
+}
+
+static void state_adopt(struct pmbus_dev *dev, const uint8_t *rec)
+{
+	size_t page, slot;
+
+	for (page = 0; page < PMBUS_PAGES; page++) {
+		struct pmbus_page_cache *cache = &dev->cache[page];
+		const uint8_t *p = &rec[8 + page * STATE_PAGE_LEN];
+
+		cache->valid = state_valid(rec, page) &
+			       GENMASK(PMBUS_CACHE_SLOTS - 1, 0);
+		for (slot = 0; slot < PMBUS_CACHE_SLOTS; slot++)
+			cache->val[slot] = state_get_le16(&p[2 + 2 * slot]);
+	}
+}
+
+/*
+ * Adopt the saved register cache of each device that passes validation.
+ * Devices that fail it, or have no record, are left to start cold. Returns
+ * the number of devices adopted.
+ */
+int state_load(const char *path, struct pmbus_dev *devs, size_t ndevs)
+{
+	uint8_t hdr[STATE_HDR_LEN];
+	uint8_t *rec;
+	size_t i, j, n;
+	int adopted;
+	FILE *f;
+	int rc;
+
+	f = fopen(path, "rb");
+	if (!f)
+		return -errno;
+
+	rec = malloc(STATE_RECORD_LEN);
+	if (!rec) {
+		rc = -ENOMEM;
+		goto cleanup_file;
+	}
+
+	if (fread(hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr, STATE_MAGIC, 4) ||
+	    hdr[4] != STATE_VERSION) {
+		rc = -EBADMSG;
+		goto cleanup_rec;
+	}
+
+	n = hdr[5];
+	adopted = 0;
+	for (i = 0; i < n; i++) {
+		if (fread(rec, STATE_RECORD_LEN, 1, f) != 1) {
+			rc = -EBADMSG;
+			goto cleanup_rec;
+		}
+
+		for (j = 0; j < ndevs; j++) {
+			if (devs[j].addr == rec[0])
+				break;
+		}
+
+		if (j == ndevs)
+			continue;
+
+		rc = state_validate(&devs[j], rec);
+		if (rc == 1) {
+			state_adopt(&devs[j], rec);
+			adopted++;
+		} else {
+			pmbus_dev_invalidate(&devs[j]);
+		}
+	}
+
+	rc = adopted;
+
+cleanup_rec:
+	free(rec);
+
+cleanup_file:
+	fclose(f);
+
+	return rc;
+}
@@ -0,0 +1,23 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef STATE_H
+#define STATE_H
+
+#include <stddef.h>
+
+struct pmbus_dev;
+
+/*
+ * A state file holds the "MXST" magic, a version byte and the device count,
+ * then a record per device: its address, a fingerprint of MFR_REVISION and
+ * MFR_MODE, and the register cache of every page. All multi-byte fields are
+ * little-endian.
+ */
+#define STATE_MAGIC	"MXST"
+#define STATE_VERSION	1
+
+int state_save(const char *path, struct pmbus_dev *devs, size_t ndevs);
+int state_load(const char *path, struct pmbus_dev *devs, size_t ndevs);
+
+#endif
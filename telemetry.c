@@ -0,0 +1,126 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "plan.h"
+#include "pmbus.h"
+#include "telemetry.h"
+
+#include <errno.h>
+#include <string.h>
+
+/* Read on every page to find the enabled fans */
+static const struct plan_op telemetry_config_op = {
+	.reg = PMBUS_FAN_CONFIG_12,
+	.width = 1,
+};
+
+/* Read only on the pages of enabled fans */
+enum telemetry_reg {
+	telemetry_fan_command,
+	telemetry_fan_speed,
+	telemetry_status_word,
+	telemetry_status_fans,
+	telemetry_nr_regs,
+};
+
+static const struct {
+	uint8_t reg;
+	uint8_t width;
+} telemetry_regs[] = {
+	[telemetry_fan_command] = { PMBUS_FAN_COMMAND_1, 2 },
+	[telemetry_fan_speed] = { PMBUS_READ_FAN_SPEED_1, 2 },
+	[telemetry_status_word] = { PMBUS_STATUS_WORD, 2 },
+	[telemetry_status_fans] = { PMBUS_STATUS_FANS_12, 1 },
+};
+
+int telemetry_sampler_init(struct telemetry_sampler *sampler)
+{
+	struct plan_op ops[MAX31785_FAN_PAGES];
+	size_t page, i;
+	int rc;
+
+	memset(sampler, 0, sizeof(*sampler));
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		ops[page] = telemetry_config_op;
+		ops[page].page = page;
+	}
+
+	rc = plan_compile(&sampler->config, ops, MAX31785_FAN_PAGES);
+	if (rc < 0)
+		return rc;
+
+	memset(ops, 0, sizeof(ops));
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		for (i = 0; i < telemetry_nr_regs; i++) {
+			ops[i].page = page;
+			ops[i].reg = telemetry_regs[i].reg;
+			ops[i].width = telemetry_regs[i].width;
+		}
+
+		rc = plan_compile(&sampler->fan[page], ops, telemetry_nr_regs);
+		if (rc < 0) {
+			telemetry_sampler_destroy(sampler);
+			return rc;
+		}
+	}
+
+	return 0;
+}
+
+void telemetry_sampler_destroy(struct telemetry_sampler *sampler)
+{
+	size_t page;
+
+	plan_destroy(&sampler->config);
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++)
+		plan_destroy(&sampler->fan[page]);
+}
+
+/*
+ * Sweep every fan page of the device, leaving @t untouched on failure. Only
+ * FAN_CONFIG is read for disabled fans, whose other fields are zeroed.
+ */
+int telemetry_sample(const struct telemetry_sampler *sampler,
+		     struct pmbus_dev *dev, struct telemetry *t)
+{
+	uint16_t config[MAX31785_FAN_PAGES];
+	uint16_t vals[telemetry_nr_regs];
+	struct telemetry sample;
+	uint8_t page;
+	int rc;
+
+	memset(&sample, 0, sizeof(sample));
+
+	rc = plan_run(&sampler->config, dev, 1, config);
+	if (rc < 0)
+		return rc;
+
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		struct telemetry_fan *fan = &sample.fan[page];
+
+		if (!(config[page] & PMBUS_FAN_CONFIG_1_ENABLED))
+			continue;
+
+		rc = plan_run(&sampler->fan[page], dev, 1, vals);
+		if (rc < 0)
+			return rc;
+
+		fan->enabled = true;
+		fan->rpm = !!(config[page] & PMBUS_FAN_CONFIG_1_MODE);
+		fan->command = vals[telemetry_fan_command];
+		fan->speed = vals[telemetry_fan_speed];
+		fan->status_word = vals[telemetry_status_word];
+		fan->status_fans = vals[telemetry_status_fans];
+	}
+
+	if (clock_gettime(CLOCK_REALTIME, &sample.ts) < 0)
+		return -errno;
+
+	*t = sample;
+
+	return 0;
+}
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+
+#include "plan.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+struct pmbus_dev;
+
+/* Fans are attached to pages 0 through 5 of the MAX31785 */
+#define MAX31785_FAN_PAGES	6
+
+struct telemetry_fan {
+	bool enabled;
+	bool rpm;		/* Commanded in RPM rather than PWM duty */
+	uint16_t command;	/* Raw FAN_COMMAND_1 */
+	uint16_t speed;		/* READ_FAN_SPEED_1, in RPM */
+	uint16_t status_word;
+	uint8_t status_fans;	/* STATUS_FANS_12 */
+};
+
+struct telemetry {
+	struct timespec ts;	/* CLOCK_REALTIME at the end of the sweep */
+	struct telemetry_fan fan[MAX31785_FAN_PAGES];
+};
+
+/*
+ * Holds the compiled sweep, which is shared by every sample: one plan reads
+ * FAN_CONFIG across the fan pages, then one per page reads the enabled fans.
+ */
+struct telemetry_sampler {
+	struct plan config;
+	struct plan fan[MAX31785_FAN_PAGES];
+};
+
+int telemetry_sampler_init(struct telemetry_sampler *sampler);
+void telemetry_sampler_destroy(struct telemetry_sampler *sampler);
+int telemetry_sample(const struct telemetry_sampler *sampler,
+		     struct pmbus_dev *dev, struct telemetry *t);
+
+#endif
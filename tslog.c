@@ -0,0 +1,656 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "tslog.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define TSLOG_MAGIC		"MXTS"
+#define TSLOG_INDEX_MAGIC	"MXTI"
+#define TSLOG_VERSION		1
+#define TSLOG_HDR_LEN		12
+#define TSLOG_BLOCK_HDR_LEN	20
+#define TSLOG_FOOTER_LEN	8
+
+static uint64_t tslog_zigzag(int64_t v)
+{
+	return ((uint64_t)v << 1) ^ (uint64_t)(v >> 63);
+}
+
+static int64_t tslog_unzigzag(uint64_t v)
+{
+	return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+static size_t tslog_varint_len(uint64_t v)
+{
+	size_t len = 1;
+
+	while (v >= 0x80) {
+		v >>= 7;
+		len++;
+	}
+
+	return len;
+}
+
+static size_t tslog_varint_put(uint8_t *buf, uint64_t v)
+{
+	size_t len = 0;
+
+	while (v >= 0x80) {
+		buf[len++] = v | 0x80;
+		v >>= 7;
+	}
+
+	buf[len++] = v;
+
+	return len;
+}
+
+static int tslog_varint_get(const uint8_t *buf, size_t len, size_t *off,
+			    uint64_t *v)
+{
+	unsigned shift;
+
+	*v = 0;
+	for (shift = 0; shift < 64; shift += 7) {
+		uint8_t b;
+
+		if (*off >= len)
+			return -EBADMSG;
+
+		b = buf[(*off)++];
+		*v |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80))
+			return 0;
+	}
+
+	return -EBADMSG;
+}
+
+static void tslog_put_le16(uint8_t *buf, uint16_t v)
+{
+	v = htole16(v);
+	memcpy(buf, &v, sizeof(v));
+}
+
+static void tslog_put_le32(uint8_t *buf, uint32_t v)
+{
+	v = htole32(v);
+	memcpy(buf, &v, sizeof(v));
+}
+
+static void tslog_put_le64(uint8_t *buf, int64_t v)
+{
+	uint64_t u = htole64(v);
+
+	memcpy(buf, &u, sizeof(u));
+}
+
+static uint16_t tslog_get_le16(const uint8_t *buf)
+{
+	uint16_t v;
+
+	memcpy(&v, buf, sizeof(v));
+
+	return le16toh(v);
+}
+
+static uint32_t tslog_get_le32(const uint8_t *buf)
+{
+	uint32_t v;
+
+	memcpy(&v, buf, sizeof(v));
+
+	return le32toh(v);
+}
+
+static int64_t tslog_get_le64(const uint8_t *buf)
+{
+	uint64_t v;
+
+	memcpy(&v, buf, sizeof(v));
+
+	return le64toh(v);
+}
+
+static int tslog_write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *p = buf;
+
+	while (len) {
+		ssize_t rc = write(fd, p, len);
+
+		if (rc < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+static int tslog_read_at(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t rc;
+
+	rc = pread(fd, buf, len, off);
+	if (rc < 0)
+		return -errno;
+
+	if ((size_t)rc != len)
+		return -EBADMSG;
+
+	return 0;
+}
+
+/* Every sample costs at least one byte in each series column */
+static size_t tslog_max_samples(size_t capacity, size_t nseries)
+{
+	return capacity / nseries + 1;
+}
+
+static size_t tslog_capacity(size_t block_size, size_t nseries)
+{
+	return block_size - TSLOG_BLOCK_HDR_LEN - 2 * (1 + nseries);
+}
+
+int tslog_writer_open(struct tslog_writer *w, const char *path,
+		      const struct tslog_series *series, size_t nseries)
+{
+	uint8_t hdr[TSLOG_BLOCK_SIZE];
+	size_t i;
+	int rc;
+
+	if (!nseries || nseries > TSLOG_SERIES_MAX)
+		return -EINVAL;
+
+	memset(w, 0, sizeof(*w));
+	w->nseries = nseries;
+	w->capacity = tslog_capacity(TSLOG_BLOCK_SIZE, nseries);
+	w->max_samples = tslog_max_samples(w->capacity, nseries);
+
+	w->ts = calloc(w->max_samples, sizeof(*w->ts));
+	w->vals = calloc(w->max_samples * nseries, sizeof(*w->vals));
+	if (!w->ts || !w->vals) {
+		rc = -ENOMEM;
+		goto cleanup_mem;
+	}
+
+	w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (w->fd < 0) {
+		rc = -errno;
+		goto cleanup_mem;
+	}
+
+	memset(hdr, 0, sizeof(hdr));
+	memcpy(hdr, TSLOG_MAGIC, 4);
+	hdr[4] = TSLOG_VERSION;
+	tslog_put_le16(&hdr[6], nseries);
+	tslog_put_le32(&hdr[8], TSLOG_BLOCK_SIZE);
+	for (i = 0; i < nseries; i++) {
+		hdr[TSLOG_HDR_LEN + 2 * i] = series[i].addr;
+		hdr[TSLOG_HDR_LEN + 2 * i + 1] = series[i].page;
+	}
+
+	rc = tslog_write_all(w->fd, hdr, sizeof(hdr));
+	if (rc < 0)
+		goto cleanup_fd;
+
+	return 0;
+
+cleanup_fd:
+	close(w->fd);
+
+cleanup_mem:
+	free(w->vals);
+	free(w->ts);
+
+	return rc;
+}
+
+static int tslog_writer_flush(struct tslog_writer *w)
+{
+	uint8_t block[TSLOG_BLOCK_SIZE];
+	struct tslog_block_index *index;
+	size_t ncols, off, start, i, s;
+	int rc;
+
+	if (!w->nsamples)
+		return 0;
+
+	index = realloc(w->index, (w->nblocks + 1) * sizeof(*index));
+	if (!index)
+		return -ENOMEM;
+	w->index = index;
+
+	memset(block, 0, sizeof(block));
+
+	ncols = 1 + w->nseries;
+	tslog_put_le16(&block[0], w->nsamples);
+	tslog_put_le16(&block[2], ncols);
+	tslog_put_le64(&block[4], w->ts[0]);
+	tslog_put_le64(&block[12], w->ts[w->nsamples - 1]);
+
+	off = TSLOG_BLOCK_HDR_LEN + 2 * ncols;
+
+	/* Timestamp column */
+	start = off;
+	for (i = 1; i < w->nsamples; i++) {
+		int64_t delta = w->ts[i] - w->ts[i - 1];
+
+		if (i > 1)
+			delta -= w->ts[i - 1] - w->ts[i - 2];
+
+		off += tslog_varint_put(&block[off], tslog_zigzag(delta));
+	}
+	tslog_put_le16(&block[TSLOG_BLOCK_HDR_LEN], off - start);
+
+	/* Series columns */
+	for (s = 0; s < w->nseries; s++) {
+		const uint16_t *v = &w->vals[s];
+
+		start = off;
+		off += tslog_varint_put(&block[off], v[0]);
+		for (i = 1; i < w->nsamples; i++) {
+			int64_t delta = (int64_t)v[i * w->nseries] -
+					v[(i - 1) * w->nseries];
+
+			off += tslog_varint_put(&block[off], tslog_zigzag(delta));
+		}
+		tslog_put_le16(&block[TSLOG_BLOCK_HDR_LEN + 2 * (1 + s)],
+			       off - start);
+	}
+
+	rc = tslog_write_all(w->fd, block, sizeof(block));
+	if (rc < 0)
+		return rc;
+
+	w->index[w->nblocks].first = w->ts[0];
+	w->index[w->nblocks].last = w->ts[w->nsamples - 1];
+	w->nblocks++;
+
+	w->nsamples = 0;
+	w->len = 0;
+
+	return 0;
+}
+
+/* The encoded cost of appending a sample to the current block */
+static size_t tslog_writer_cost(const struct tslog_writer *w, int64_t t_us,
+				const uint16_t *vals)
+{
+	const uint16_t *prev;
+	size_t n = w->nsamples;
+	size_t cost, s;
+
+	if (!n) {
+		for (s = 0, cost = 0; s < w->nseries; s++)
+			cost += tslog_varint_len(vals[s]);
+
+		return cost;
+	}
+
+	if (n == 1)
+		cost = tslog_varint_len(tslog_zigzag(t_us - w->ts[0]));
+	else
+		cost = tslog_varint_len(tslog_zigzag((t_us - w->ts[n - 1]) -
+						     (w->ts[n - 1] - w->ts[n - 2])));
+
+	prev = &w->vals[(n - 1) * w->nseries];
+	for (s = 0; s < w->nseries; s++)
+		cost += tslog_varint_len(tslog_zigzag((int64_t)vals[s] - prev[s]));
+
+	return cost;
+}
+
+/* Timestamps must not decrease, as the index assumes ordered blocks */
+int tslog_writer_append(struct tslog_writer *w, int64_t t_us,
+			const uint16_t *vals)
+{
+	size_t cost;
+	int rc;
+
+	if (w->nsamples && t_us < w->ts[w->nsamples - 1])
+		return -EINVAL;
+
+	cost = tslog_writer_cost(w, t_us, vals);
+	if (w->nsamples == w->max_samples || w->len + cost > w->capacity) {
+		rc = tslog_writer_flush(w);
+		if (rc < 0)
+			return rc;
+
+		cost = tslog_writer_cost(w, t_us, vals);
+	}
+
+	w->ts[w->nsamples] = t_us;
+	memcpy(&w->vals[w->nsamples * w->nseries], vals,
+	       w->nseries * sizeof(*vals));
+	w->nsamples++;
+	w->len += cost;
+
+	return 0;
+}
+
+int tslog_writer_close(struct tslog_writer *w)
+{
+	uint8_t footer[TSLOG_FOOTER_LEN];
+	size_t i;
+	int rc;
+
+	rc = tslog_writer_flush(w);
+	if (rc < 0)
+		goto cleanup;
+
+	for (i = 0; i < w->nblocks; i++) {
+		uint8_t entry[2 * sizeof(int64_t)];
+
+		tslog_put_le64(&entry[0], w->index[i].first);
+		tslog_put_le64(&entry[8], w->index[i].last);
+
+		rc = tslog_write_all(w->fd, entry, sizeof(entry));
+		if (rc < 0)
+			goto cleanup;
+	}
+
+	tslog_put_le32(&footer[0], w->nblocks);
+	memcpy(&footer[4], TSLOG_INDEX_MAGIC, 4);
+	rc = tslog_write_all(w->fd, footer, sizeof(footer));
+
+cleanup:
+	if (close(w->fd) < 0 && !rc)
+		rc = -errno;
+
+	free(w->index);
+	free(w->vals);
+	free(w->ts);
+
+	return rc;
+}
+
+static int tslog_reader_load_index(struct tslog_reader *r, off_t size)
+{
+	uint8_t footer[TSLOG_FOOTER_LEN];
+	off_t data_len;
+	uint8_t *raw;
+	size_t i;
+	int rc;
+
+	data_len = size - r->block_size;
+
+	/* Index entries and the footer never add up to a whole block */
+	if (!(data_len % r->block_size)) {
+		r->nblocks = data_len / r->block_size;
+		return 0;
+	}
+
+	rc = tslog_read_at(r->fd, footer, sizeof(footer), size - sizeof(footer));
+	if (rc < 0)
+		return rc;
+
+	r->nblocks = tslog_get_le32(&footer[0]);
+	if (memcmp(&footer[4], TSLOG_INDEX_MAGIC, 4) ||
+	    (off_t)(r->nblocks * (r->block_size + 16) + sizeof(footer)) != data_len) {
+		/* Treat anything else as a torn write after the last block */
+		r->nblocks = data_len / r->block_size;
+		return 0;
+	}
+
+	raw = malloc(r->nblocks * 16 ?: 1);
+	r->index = calloc(r->nblocks ?: 1, sizeof(*r->index));
+	if (!raw || !r->index) {
+		free(raw);
+		return -ENOMEM;
+	}
+
+	rc = tslog_read_at(r->fd, raw, r->nblocks * 16,
+			   r->block_size * (1 + r->nblocks));
+	if (rc < 0) {
+		free(raw);
+		return rc;
+	}
+
+	for (i = 0; i < r->nblocks; i++) {
+		r->index[i].first = tslog_get_le64(&raw[16 * i]);
+		r->index[i].last = tslog_get_le64(&raw[16 * i + 8]);
+	}
+
+	free(raw);
+
+	return 0;
+}
+
+int tslog_reader_open(struct tslog_reader *r, const char *path)
+{
+	uint8_t hdr[TSLOG_HDR_LEN + 2 * TSLOG_SERIES_MAX];
+	size_t max_samples, i;
+	struct stat st;
+	int rc;
+
+	memset(r, 0, sizeof(*r));
+
+	r->fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (r->fd < 0)
+		return -errno;
+
+	if (fstat(r->fd, &st) < 0) {
+		rc = -errno;
+		goto cleanup_fd;
+	}
+
+	rc = tslog_read_at(r->fd, hdr, sizeof(hdr), 0);
+	if (rc < 0)
+		goto cleanup_fd;
+
+	r->nseries = tslog_get_le16(&hdr[6]);
+	r->block_size = tslog_get_le32(&hdr[8]);
+	if (memcmp(hdr, TSLOG_MAGIC, 4) || hdr[4] != TSLOG_VERSION ||
+	    !r->nseries || r->nseries > TSLOG_SERIES_MAX ||
+	    r->block_size != TSLOG_BLOCK_SIZE || st.st_size < (off_t)r->block_size) {
+		rc = -EBADMSG;
+		goto cleanup_fd;
+	}
+
+	for (i = 0; i < r->nseries; i++) {
+		r->series[i].addr = hdr[TSLOG_HDR_LEN + 2 * i];
+		r->series[i].page = hdr[TSLOG_HDR_LEN + 2 * i + 1];
+	}
+
+	rc = tslog_reader_load_index(r, st.st_size);
+	if (rc < 0)
+		goto cleanup_mem;
+
+	max_samples = tslog_max_samples(tslog_capacity(r->block_size, r->nseries),
+					r->nseries);
+	r->ts = calloc(max_samples, sizeof(*r->ts));
+	r->vals = calloc(max_samples * r->nseries, sizeof(*r->vals));
+	if (!r->ts || !r->vals) {
+		rc = -ENOMEM;
+		goto cleanup_mem;
+	}
+
+	return 0;
+
+cleanup_mem:
+	free(r->vals);
+	free(r->ts);
+	free(r->index);
+
+cleanup_fd:
+	close(r->fd);
+
+	return rc;
+}
+
+void tslog_reader_close(struct tslog_reader *r)
+{
+	free(r->vals);
+	free(r->ts);
+	free(r->index);
+	close(r->fd);
+}
+
+static int tslog_reader_range(struct tslog_reader *r, size_t block,
+			      struct tslog_block_index *range)
+{
+	uint8_t hdr[TSLOG_BLOCK_HDR_LEN];
+	int rc;
+
+	if (r->index) {
+		*range = r->index[block];
+		return 0;
+	}
+
+	rc = tslog_read_at(r->fd, hdr, sizeof(hdr), r->block_size * (1 + block));
+	if (rc < 0)
+		return rc;
+
+	range->first = tslog_get_le64(&hdr[4]);
+	range->last = tslog_get_le64(&hdr[12]);
+
+	return 0;
+}
+
+static int tslog_reader_load(struct tslog_reader *r, size_t block)
+{
+	uint8_t buf[TSLOG_BLOCK_SIZE];
+	size_t ncols, n, off, end, i, s;
+	uint64_t v;
+	int rc;
+
+	rc = tslog_read_at(r->fd, buf, r->block_size, r->block_size * (1 + block));
+	if (rc < 0)
+		return rc;
+
+	n = tslog_get_le16(&buf[0]);
+	ncols = tslog_get_le16(&buf[2]);
+	if (ncols != 1 + r->nseries || !n ||
+	    n > tslog_max_samples(tslog_capacity(r->block_size, r->nseries),
+				  r->nseries))
+		return -EBADMSG;
+
+	off = TSLOG_BLOCK_HDR_LEN + 2 * ncols;
+
+	r->ts[0] = tslog_get_le64(&buf[4]);
+	end = off + tslog_get_le16(&buf[TSLOG_BLOCK_HDR_LEN]);
+	if (end > r->block_size)
+		return -EBADMSG;
+
+	for (i = 1; i < n; i++) {
+		int64_t delta;
+
+		rc = tslog_varint_get(buf, end, &off, &v);
+		if (rc < 0)
+			return rc;
+
+		delta = tslog_unzigzag(v);
+		if (i > 1)
+			delta += r->ts[i - 1] - r->ts[i - 2];
+
+		r->ts[i] = r->ts[i - 1] + delta;
+	}
+
+	for (s = 0; s < r->nseries; s++) {
+		uint16_t *vals = &r->vals[s];
+
+		off = end;
+		end = off + tslog_get_le16(&buf[TSLOG_BLOCK_HDR_LEN + 2 * (1 + s)]);
+		if (end > r->block_size)
+			return -EBADMSG;
+
+		rc = tslog_varint_get(buf, end, &off, &v);
+		if (rc < 0)
+			return rc;
+
+		vals[0] = v;
+		for (i = 1; i < n; i++) {
+			rc = tslog_varint_get(buf, end, &off, &v);
+			if (rc < 0)
+				return rc;
+
+			vals[i * r->nseries] = vals[(i - 1) * r->nseries] +
+					       tslog_unzigzag(v);
+		}
+	}
+
+	r->block = block + 1;
+	r->nsamples = n;
+	r->cursor = 0;
+
+	return 0;
+}
+
+/*
+ * Position the reader at the first sample at or after @t_us, touching only
+ * the index (or O(log n) block headers) and the block holding that sample.
+ */
+int tslog_reader_seek(struct tslog_reader *r, int64_t t_us)
+{
+	struct tslog_block_index range;
+	size_t lo, hi;
+	int rc;
+
+	lo = 0;
+	hi = r->nblocks;
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		rc = tslog_reader_range(r, mid, &range);
+		if (rc < 0)
+			return rc;
+
+		if (range.last < t_us)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	r->nsamples = 0;
+	r->cursor = 0;
+	r->block = lo;
+	if (lo == r->nblocks)
+		return 0;
+
+	rc = tslog_reader_load(r, lo);
+	if (rc < 0)
+		return rc;
+
+	while (r->cursor < r->nsamples && r->ts[r->cursor] < t_us)
+		r->cursor++;
+
+	return 0;
+}
+
+/* Returns 1 and the next sample, or 0 at the end of the log */
+int tslog_reader_next(struct tslog_reader *r, int64_t *t_us, uint16_t *vals)
+{
+	int rc;
+
+	while (r->cursor == r->nsamples) {
+		if (r->block >= r->nblocks)
+			return 0;
+
+		rc = tslog_reader_load(r, r->block);
+		if (rc < 0)
+			return rc;
+	}
+
+	*t_us = r->ts[r->cursor];
+	memcpy(vals, &r->vals[r->cursor * r->nseries],
+	       r->nseries * sizeof(*vals));
+	r->cursor++;
+
+	return 1;
+}
@@ -0,0 +1,89 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef TSLOG_H
+#define TSLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A log is a header block followed by fixed-size data blocks, and an index
+ * once the log is closed. The header block holds the "MXTS" magic, a version
+ * byte, a reserved byte, the 16-bit series count, the 32-bit block size and
+ * an (address, page) pair per series.
+ *
+ * Each data block holds a run of samples stored column by column: a block
+ * header with the sample count, the first and last timestamps and the byte
+ * length of each column, then the timestamp column followed by one column per
+ * series. Timestamps are in microseconds and encoded as zigzag varints of the
+ * delta-of-delta from the block's first timestamp. Series values are encoded
+ * as a plain varint for the first sample and zigzag varint deltas after that.
+ *
+ * The index is an array of (first, last) timestamps per block followed by the
+ * block count and the "MXTI" magic. Logs that were not closed lack the index,
+ * and are searched through their block headers instead.
+ */
+
+#define TSLOG_BLOCK_SIZE	4096
+
+/*
+ * A sample costs at most three bytes per series, so a block still holds
+ * several samples at this many series
+ */
+#define TSLOG_SERIES_MAX	256
+
+struct tslog_series {
+	uint8_t addr;
+	uint8_t page;
+};
+
+struct tslog_block_index {
+	int64_t first;
+	int64_t last;
+};
+
+struct tslog_writer {
+	int fd;
+	size_t nseries;
+	size_t capacity;		/* Bytes available for columns */
+	size_t max_samples;
+
+	/* The block being accumulated, encoded when it is full */
+	size_t nsamples;
+	size_t len;			/* Encoded length of all columns */
+	int64_t *ts;
+	uint16_t *vals;
+
+	struct tslog_block_index *index;
+	size_t nblocks;
+};
+
+int tslog_writer_open(struct tslog_writer *w, const char *path,
+		      const struct tslog_series *series, size_t nseries);
+int tslog_writer_append(struct tslog_writer *w, int64_t t_us,
+			const uint16_t *vals);
+int tslog_writer_close(struct tslog_writer *w);
+
+struct tslog_reader {
+	int fd;
+	size_t nseries;
+	struct tslog_series series[TSLOG_SERIES_MAX];
+	size_t block_size;
+	size_t nblocks;
+	struct tslog_block_index *index;	/* NULL if the log lacks one */
+
+	/* The decoded block */
+	size_t block;
+	size_t nsamples;
+	size_t cursor;
+	int64_t *ts;
+	uint16_t *vals;
+};
+
+int tslog_reader_open(struct tslog_reader *r, const char *path);
+int tslog_reader_seek(struct tslog_reader *r, int64_t t_us);
+int tslog_reader_next(struct tslog_reader *r, int64_t *t_us, uint16_t *vals);
+void tslog_reader_close(struct tslog_reader *r);
+
+#endif
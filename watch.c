@@ -0,0 +1,67 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright (C) 2020 IBM Corp.
+
+#include "bits.h"
+#include "watch.h"
+
+#include <string.h>
+
+void watch_init(struct watch_state *state)
+{
+	memset(state, 0, sizeof(*state));
+}
+
+static bool watch_fan_changed(const struct watch_config *cfg,
+			      const struct telemetry_fan *last,
+			      const struct telemetry_fan *fan)
+{
+	unsigned delta;
+
+	if (fan->enabled != last->enabled || fan->rpm != last->rpm ||
+	    fan->command != last->command ||
+	    fan->status_word != last->status_word ||
+	    fan->status_fans != last->status_fans)
+		return true;
+
+	delta = fan->speed > last->speed ? fan->speed - last->speed :
+					   last->speed - fan->speed;
+
+	return delta > cfg->rpm_deadband;
+}
+
+/*
+ * Returns a mask of the fan pages in @t that should be reported, and sets
+ * @keyframe when every page is reported regardless of change. Comparing
+ * against the last reported values rather than the previous sample stops a
+ * slow drift from hiding inside the deadband.
+ */
+unsigned watch_update(const struct watch_config *cfg, struct watch_state *state,
+		      const struct telemetry *t, bool *keyframe)
+{
+	unsigned changed;
+	int page;
+
+	*keyframe = !state->primed ||
+		    (cfg->keyframe_interval &&
+		     ++state->since_keyframe >= cfg->keyframe_interval);
+
+	if (*keyframe) {
+		state->last = *t;
+		state->primed = true;
+		state->since_keyframe = 0;
+		return GENMASK(MAX31785_FAN_PAGES - 1, 0);
+	}
+
+	changed = 0;
+	for (page = 0; page < MAX31785_FAN_PAGES; page++) {
+		if (!watch_fan_changed(cfg, &state->last.fan[page], &t->fan[page]))
+			continue;
+
+		state->last.fan[page] = t->fan[page];
+		changed |= BIT(page);
+	}
+
+	state->last.ts = t->ts;
+
+	return changed;
+}
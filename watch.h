@@ -0,0 +1,28 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+/* Copyright (C) 2020 IBM Corp. */
+
+#ifndef WATCH_H
+#define WATCH_H
+
+#include "telemetry.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+struct watch_config {
+	unsigned rpm_deadband;		/* Speed change that warrants a record */
+	unsigned keyframe_interval;	/* Sweeps between keyframes, 0 for none */
+};
+
+/* Tracks the values last reported for each fan, not the last sample */
+struct watch_state {
+	struct telemetry last;
+	bool primed;
+	unsigned since_keyframe;
+};
+
+void watch_init(struct watch_state *state);
+unsigned watch_update(const struct watch_config *cfg, struct watch_state *state,
+		      const struct telemetry *t, bool *keyframe);
+
+#endif